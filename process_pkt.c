@@ -44,6 +44,153 @@ int CheckPureTCPAck(unsigned char* buffer)
 }
 
 
+/**
+ * A GSO super-packet carries the payload of several segments of gso_size
+ * bytes each behind a single TCP/UDP header, the last one can be shorter.
+ *
+ * @brief	Returns the number of segments of a packet
+ * @param	buffer Pointer to the IPv4 or IPv6 package
+ * @param	gso_size Payload of each segment (gso_size of the virtio-net header), 0 if not GSO
+ * @return	Number of segments, 1 if not GSO
+ *
+ */
+int getSegments(unsigned char *buffer, int gso_size)
+{
+	unsigned int hdrlen, length, proto;
+	struct iphdr *iph = (struct iphdr*)buffer;
+	struct ip6_hdr *ip6h = (struct ip6_hdr*)buffer;
+
+	if (gso_size <= 0) return 1;
+	if (iph->version == 6) {
+		hdrlen = sizeof(struct ip6_hdr);
+		length = hdrlen + ntohs(ip6h->ip6_plen);
+		proto = ip6h->ip6_nxt;
+	} else {
+		hdrlen = iph->ihl*4;
+		length = ntohs(iph->tot_len);
+		proto = iph->protocol;
+	}
+	if (proto == IPPROTO_TCP)
+		hdrlen += ((struct tcphdr*)(buffer + hdrlen))->doff*4;
+	else if (proto == IPPROTO_UDP)
+		hdrlen += sizeof(struct udphdr);
+	if (length <= hdrlen) return 1;
+	return (length - hdrlen + gso_size - 1)/gso_size;
+}
+
+
+/**
+ * Locates the transport header and payload of an IPv4 or IPv6 packet and
+ * hashes its 5-tuple (the ports only for TCP and UDP). Anything else
+ * hashes to 0.
+ *
+ * @brief	Returns the flow hash of a packet
+ * @param	buffer Pointer to the IP package
+ * @param	length Length of the package
+ * @param	proto Transport protocol (output)
+ * @param	l4off Offset of the transport header (output)
+ * @param	payoff Offset of the transport payload (output)
+ * @return	Flow hash, never 0 for an IP packet
+ *
+ */
+uint32_t getFlowHash(unsigned char *buffer, int length, uint8_t *proto, uint16_t *l4off, uint16_t *payoff)
+{
+	struct iphdr *iph = (struct iphdr*)buffer;
+	struct ip6_hdr *ip6h = (struct ip6_hdr*)buffer;
+	uint32_t tuple[3] = { 0, 0, 0 };
+	uint32_t h;
+	int hdrlen, i;
+
+	*proto = 0;
+	*l4off = *payoff = 0;
+	if (length >= (int)sizeof(struct ip6_hdr) && iph->version == 6) {
+		hdrlen = sizeof(struct ip6_hdr);
+		*proto = ip6h->ip6_nxt;
+		for (i = 0; i < 4; i++) {
+			tuple[0] ^= ip6h->ip6_src.s6_addr32[i];
+			tuple[1] ^= ip6h->ip6_dst.s6_addr32[i];
+		}
+	} else if (length >= (int)sizeof(struct iphdr) && iph->version == 4) {
+		hdrlen = iph->ihl*4;
+		*proto = iph->protocol;
+		tuple[0] = iph->saddr;
+		tuple[1] = iph->daddr;
+	} else {
+		return 0;
+	}
+	*l4off = *payoff = hdrlen;
+	if (*proto == IPPROTO_TCP && length >= hdrlen + (int)sizeof(struct tcphdr)) {
+		memcpy(&tuple[2], buffer + hdrlen, sizeof(tuple[2]));	// source and destination ports
+		*payoff = hdrlen + ((struct tcphdr*)(buffer + hdrlen))->doff*4;
+	} else if (*proto == IPPROTO_UDP && length >= hdrlen + (int)sizeof(struct udphdr)) {
+		memcpy(&tuple[2], buffer + hdrlen, sizeof(tuple[2]));
+		*payoff = hdrlen + sizeof(struct udphdr);
+	}
+
+	// murmur3 rounds over the tuple
+	h = 0x9e3779b9 ^ *proto;
+	for (i = 0; i < 3; i++) {
+		h ^= tuple[i] * 0xcc9e2d51;
+		h = ((h << 13) | (h >> 19))*5 + 0xe6546b64;
+	}
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h ? h : 1;
+}
+
+
+/**
+ * Control packets are worth much more to their flows than their bytes:
+ * pure ACKs clock the senders, SYN and RST open and reset connections,
+ * ICMP carries errors and probes. A TCP segment is taken as control if it
+ * opens or resets a connection or carries no payload (pure ACKs and FINs).
+ * The IP length is used, frames can be padded.
+ *
+ * @brief	Check if the package is a control package
+ * @param	buffer Pointer to the IP package
+ * @param	proto Transport protocol, as returned by getFlowHash
+ * @param	l4off Offset of the transport header, as returned by getFlowHash
+ * @param	payoff Offset of the transport payload, as returned by getFlowHash
+ * @return	1 if true 0 if false
+ *
+ */
+int CheckControlPacket(unsigned char *buffer, uint8_t proto, uint16_t l4off, uint16_t payoff)
+{
+	struct iphdr *iph = (struct iphdr*)buffer;
+	struct ip6_hdr *ip6h = (struct ip6_hdr*)buffer;
+	struct tcphdr *tcph = (struct tcphdr*)(buffer + l4off);
+	int length;
+
+	if (proto == IPPROTO_ICMP || proto == IPPROTO_ICMPV6) return 1;
+	// without its whole header a segment is not classified
+	if (proto != IPPROTO_TCP || payoff <= l4off) return 0;
+	if (tcph->syn || tcph->rst) return 1;
+	if (iph->version == 6)
+		length = sizeof(struct ip6_hdr) + ntohs(ip6h->ip6_plen);
+	else
+		length = ntohs(iph->tot_len);
+	return length <= payoff;
+}
+
+/**
+ * @brief	Returns the DSCP of an IPv4 or IPv6 packet
+ * @param	buffer Pointer to the IP packet
+ * @return	DSCP, 0 if not IP
+ *
+ */
+int getDSCP(unsigned char *buffer)
+{
+	struct iphdr *iph = (struct iphdr*)buffer;
+
+	if (iph->version == 6) return ((buffer[0] & 0x0f) << 2) | (buffer[1] >> 6);
+	if (iph->version == 4) return iph->tos >> 2;
+	return 0;
+}
+
+
 /**
  * @brief	Returns the ACK sequence
  * @param	buffer Pointer to the TCP package
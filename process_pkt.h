@@ -14,6 +14,7 @@
 #include<netinet/udp.h>   //Provides declarations for udp header
 #include<netinet/tcp.h>   //Provides declarations for tcp header
 #include<netinet/ip.h>    //Provides declarations for ip header
+#include<netinet/ip6.h>   //Provides declarations for ipv6 header
 #include<sys/socket.h>
 #include<arpa/inet.h>
 
@@ -54,7 +55,11 @@ struct pseudo_header
 int getACKSeq(unsigned char* buffer);
 int getTCPSeq(unsigned char *buffer);
 int CheckPureTCPAck(unsigned char* buffer); 
+int CheckControlPacket(unsigned char *buffer, uint8_t proto, uint16_t l4off, uint16_t payoff);
+int getDSCP(unsigned char *buffer);
+int getSegments(unsigned char *buffer, int gso_size);
 uint32_t getTimestampVal(unsigned char* buffer);
+uint32_t getFlowHash(unsigned char *buffer, int length, uint8_t *proto, uint16_t *l4off, uint16_t *payoff);
 void hexDump(void *addr, int len);
 unsigned short csum(unsigned short *ptr,int nbytes);
 unsigned char* create_dupack(unsigned char *pkt, int plus, uint32_t timestamp);
@@ -9,19 +9,24 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <errno.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <time.h>
 #include <math.h> /*ceilf*/
 #include <string.h>
 #include <limits.h>
 #include <stdlib.h> /* exit() */
 
 #include "queue.h"
+#include "process_pkt.h"
 
-float a = 0.5;
+float a = QUEUE_WEIGHT;
+/* set by the program to output debug information */
+extern int debug;
 
 /**
  * Exponential Weighted Moving Average of the queue
@@ -37,6 +42,24 @@ static inline float ewma(float a, float ewma_last, int Qcurrent ) {
 	return (1-a)*ewma_last + a*Qcurrent;
 }
 
+/**
+ * Fills the descriptor of a packet being enqueued: its length and segments,
+ * the enqueue time and where its headers are, with its flow hash
+ *
+ * @brief	Fills a pktdesc_t
+ * @param	d Descriptor of the slot
+ * @param	pkt Packet being enqueued
+ * @param	now Enqueue time
+ *
+ */
+static inline void desc_fill(pktdesc_t *d, packet_t *pkt, struct timeval *now) {
+	d->pkt = pkt;
+	d->length = pkt->length;
+	d->segs = pkt->segs;
+	d->ptimein = *now;
+	d->hash = getFlowHash(pkt->data, pkt->length, &d->proto, &d->l4off, &d->payoff);
+}
+
 /**
  * Checks if a pkqueue_t is empty
  *
@@ -46,12 +69,12 @@ static inline float ewma(float a, float ewma_last, int Qcurrent ) {
  *
  */
 int isempty(pktqueue_t *p) {
-	if (p->front == p->rear) return 1;
+	if (p->fullness == 0) return 1;
 	else return 0;
 }
 
 /**
- * Prints the current state of the queue, the buffer size, the front, rear, fullness, smooth fullnes and fullness in bytes
+ * Prints the current state of the queue, the buffer size, the front, rear, fullness, smooth fullnes, fullness in bytes and in segments
  * 
  * @brief	Prints the current state of the queue
  * @param	p Packetqueue
@@ -61,15 +84,75 @@ int isempty(pktqueue_t *p) {
 void print_queue(pktqueue_t *p, char ev) {
 
 	struct timeval now;
+	if (!debug) return;
 	gettimeofday(&now,NULL);
-	do_debug("%s %c (%ld.%.6ld): buffer_size=%ld, front=%d, rear=%d, fullness=%d, sfullness=%.2f, bfullness=%d\n",
+	do_debug("%s %c (%ld.%.6ld): buffer_size=%ld, front=%d, rear=%d, fullness=%d, sfullness=%.2f, bfullness=%d, segfullness=%d, blimit=%d, threshold=%d, drops=%lu/%lu/%lu/%lu\n",
 				p->Qname, ev, now.tv_sec, now.tv_usec, p->buffer_size, p->front, p->rear, p->fullness, 
-				p->sfullness, p->bfullness);
+				p->sfullness, p->bfullness, p->segfullness, p->blimit, queue_threshold(p),
+				p->drops[DROP_OVERFLOW], p->drops[DROP_OVERLIMIT], p->drops[DROP_THRESHOLD], p->drops[DROP_AQM]);
 	if(isempty(p)) {
 		do_debug("%s: Queue empty\n",p->Qname);
 	} 
+	if (p->classes != NULL) print_classes(p);
+}
+
+
+/**
+ * Tail drop: the arriving packet is dropped
+ *
+ * @brief	Tail drop victim
+ * @param	p Queue
+ * @return	-1
+ *
+ */
+static int victim_tail(pktqueue_t *p __attribute__((unused))) {
+	return -1;
+}
+
+/**
+ * Head drop: the packet at the front is dropped, so the sender learns of
+ * the loss a whole queue drain sooner than from a tail drop
+ *
+ * @brief	Head drop victim
+ * @param	p Queue
+ * @return	0
+ *
+ */
+static int victim_head(pktqueue_t *p __attribute__((unused))) {
+	return 0;
+}
+
+/**
+ * Random drop: any of the queued packets or the arriving one is dropped
+ * with the same probability, so the flows holding most of the queue are
+ * the most likely to lose a packet
+ *
+ * @brief	Random drop victim
+ * @param	p Queue
+ * @return	Position of the queued packet, -1 for the arriving one
+ *
+ */
+static int victim_random(pktqueue_t *p) {
+	int v = rand_r(&p->seed)%(p->fullness + 1);
+	return v == p->fullness ? -1 : v;
 }
 
+static const droppolicy_t drop_policies[] = {
+	{ "tail", victim_tail },
+	{ "head", victim_head },
+	{ "random", victim_random },
+	{ NULL, NULL }
+};
+
+/* why a packet is dropped, by DROP_* reason */
+static const char *drop_reasons[] = {
+	"no slot left",
+	"over the byte limit",
+	"over the shared buffer threshold",
+	"dropped by the AQM"
+};
+
+_Static_assert(sizeof(drop_reasons)/sizeof(drop_reasons[0]) == DROP_REASONS, "a drop reason has no name");
 
 /**
  * Initializes pktqueue_t structure values.
@@ -85,84 +168,1971 @@ void queue_init(pktqueue_t *p, int queuesize, char *Qname) {
     p->buffer_size = queuesize;
 	p->fullness=0;
 	p->sfullness=0;
+	p->weight=a;
 	p->bfullness=0;
+	p->segfullness=0;
+	p->blimit=p->blimit_max=0;
+	p->overlimit=0;
+	p->share=NULL;
+	p->policy=&drop_policies[0];
+	p->release=NULL;
+	p->seed=(unsigned int)(uintptr_t)p ^ (unsigned int)time(NULL);
+	memset(p->drops, 0, sizeof(p->drops));
+	p->prio=NULL;
+	p->prio_cap=p->prio_run=0;
+	p->aqm=NULL;
+	p->aqm_params=NULL;
+	p->aqm_mark=0;
+	p->signals=0;
+	p->fq=NULL;
+	p->classes=NULL;
+	p->nclasses=p->cls_cur=0;
+	p->drain=0;
 	p->rear=p->front=0;
-	p->arr = (packet_t **) malloc((p->buffer_size)*sizeof(packet_t *));
+	p->desc = (pktdesc_t *) malloc((p->buffer_size)*sizeof(pktdesc_t));
     do_debug("Initializing packet queue %s\n", Qname);
     print_queue(p,'i');
 }
 
 /**
- * Enqueues a packet_t in a pktqueue_t and updates it's data
- * 
- * @brief	Enqueues a packet_t
- * @param	p Queue to enqueue the packet
- * @param	pkt Packet to enqueue
- * @return	1 if it succeeded 0 if it didn't
- * 
+ * Looks a drop policy up by name: tail, head or random
+ *
+ * @brief	Finds a drop policy
+ * @param	name Name of the policy
+ * @return	The policy, NULL if there is none by that name
+ *
  */
-int enqueue_packet(pktqueue_t *p, packet_t *pkt) {
-	int t;
-    do_debug("%s: enqueue_packet\n",p->Qname);
-	t = (p->rear+1)%p->buffer_size;
-	if (t == p->front) {
-		do_debug("\n%s: Queue Overflow\n", p->Qname);
-		return 0;
+const droppolicy_t *drop_policy(char *name) {
+	const droppolicy_t *d;
+
+	for (d = drop_policies; d->name != NULL; d++)
+		if (strcmp(d->name, name) == 0) return d;
+	return NULL;
+}
+
+/**
+ * Sets what a pktqueue_t drops when it refuses a packet. Queued packets
+ * dropped by the policy are freed with release; the arriving ones are
+ * returned to the caller of enqueue_batch, as with tail drop.
+ *
+ * @brief	Sets the drop policy of a pktqueue_t
+ * @param	p Queue
+ * @param	policy Drop policy, see drop_policy
+ * @param	release Frees a dropped packet
+ *
+ */
+void queue_policy(pktqueue_t *p, const droppolicy_t *policy, void (*release)(void *)) {
+	p->policy = policy;
+	p->release = release;
+	do_debug("%s: %s drop\n", p->Qname, policy->name);
+}
+
+/**
+ * Drops the i-th queued packet from the front. The packets before it move
+ * one slot towards the rear, so the order of the queue is kept.
+ *
+ * @brief	Drops a queued packet
+ * @param	p Queue, not empty
+ * @param	i Position of the packet from the front
+ * @return	Length of the dropped packet
+ *
+ */
+static int queue_evict(pktqueue_t *p, int i) {
+	int pos = (p->front + 1 + i)%p->buffer_size, prev;
+	pktdesc_t victim = p->desc[pos];
+
+	while (pos != (p->front + 1)%p->buffer_size) {
+		prev = (pos - 1 + p->buffer_size)%p->buffer_size;
+		p->desc[pos] = p->desc[prev];
+		pos = prev;
 	}
-	else {
-		p->rear=t;
-		p->arr[p->rear]= pkt;
-		p->fullness++;
-		p->sfullness = ewma(a, p->sfullness, p->fullness);
-        p->bfullness+=pkt->length;
-		print_queue(p, 'e'); 
-		return 1;
+	p->front = pos;
+	p->fullness--;
+	p->bfullness -= victim.length;
+	p->segfullness -= victim.segs;
+	if (p->share != NULL) __atomic_sub_fetch(&p->share->used, victim.length, __ATOMIC_RELAXED);
+	p->release(victim.pkt);
+	return victim.length;
+}
+
+/**
+ * Tells why a pktqueue_t refuses a packet, if it does
+ *
+ * @brief	Checks the admission of a packet
+ * @param	p Queue
+ * @param	length Length of the arriving packet
+ * @param	threshold Shared buffer threshold of the queue
+ * @return	Drop reason, -1 if the packet is admitted
+ *
+ */
+static inline int queue_refuses(pktqueue_t *p, int length, int threshold) {
+	if (p->fullness >= p->buffer_size - 1) return DROP_OVERFLOW;
+	// an empty queue takes any packet, so the limit never starves it
+	if (p->blimit > 0 && p->fullness > 0 && p->bfullness + length > p->blimit) return DROP_OVERLIMIT;
+	if (p->share != NULL && p->bfullness >= threshold) return DROP_THRESHOLD;
+	return -1;
+}
+
+/**
+ * Limits the bytes a pktqueue_t holds on top of its slots. A dynamic limit
+ * starts at bytes and follows the drain of the queue, told by queue_tick,
+ * between an MTU and bytes.
+ *
+ * @brief	Sets the byte limit of a pktqueue_t
+ * @param	p Queue
+ * @param	bytes Limit in bytes, 0 for none
+ * @param	dynamic Let the limit follow the drain
+ *
+ */
+void queue_limit(pktqueue_t *p, int bytes, int dynamic) {
+	p->blimit = bytes;
+	p->blimit_max = dynamic ? bytes : 0;
+	p->overlimit = 0;
+	p->slack = INT_MAX;
+	gettimeofday(&p->slack_start, NULL);
+	do_debug("%s: byte limit %d%s\n", p->Qname, bytes, dynamic ? " (dynamic)" : "");
+}
+
+/**
+ * Gives a pktqueue_t a priority band for control packets (see
+ * CheckControlPacket) with the same shared buffer and drop policy, so it
+ * must be called after queue_share and queue_policy. The band holds up to
+ * cap bytes and is served first, but while the queue waits it sends no
+ * more than cap bytes in a row, so the bulk packets are never starved.
+ *
+ * @brief	Adds a priority band to a pktqueue_t
+ * @param	p Queue, empty
+ * @param	cap Bytes of the band
+ *
+ */
+void queue_prio(pktqueue_t *p, int cap) {
+	char Qname[10];
+
+	p->prio = (pktqueue_t *) malloc(sizeof(pktqueue_t));
+	snprintf(Qname, sizeof(Qname), "%.8s+", p->Qname);
+	queue_init(p->prio, cap/QUEUE_CTLPKT + 2, Qname);
+	queue_limit(p->prio, cap, 0);
+	p->prio->share = p->share;
+	p->prio->policy = p->policy;
+	p->prio->release = p->release;
+	p->prio_cap = cap;
+	p->prio_run = 0;
+}
+
+/**
+ * Chooses the band of a pktqueue_t the next packet departs from, the ip-th
+ * of the priority band or the ib-th of the queue: the priority band unless
+ * it has sent prio_cap bytes in a row while the queue waits
+ *
+ * @brief	Picks the band of the next departure
+ * @param	p Queue
+ * @param	ip Packets of the priority band already departed
+ * @param	ib Packets of the queue already departed
+ * @param	run Bytes the priority band sent in a row, updated
+ * @return	The band, NULL if both are empty
+ *
+ */
+static pktqueue_t *band_next(pktqueue_t *p, int ip, int ib, int *run) {
+	int waits = ib < p->fullness;
+
+	if (p->prio != NULL && ip < p->prio->fullness && (!waits || *run < p->prio_cap)) {
+		if (waits) *run += p->prio->desc[(p->prio->front + 1 + ip)%p->prio->buffer_size].length;
+		return p->prio;
 	}
+	if (!waits) return NULL;
+	*run = 0;
+	return p;
 }
 
+/**
+ * Integer square root, by Newton's method
+ *
+ * @brief	Square root of x
+ * @param	x Number
+ * @return	Square root of x, rounded down
+ *
+ */
+static unsigned long isqrt(unsigned long x) {
+	unsigned long r = x, y = (x + 1)/2;
+
+	while (y < r) {
+		r = y;
+		y = (r + x/r)/2;
+	}
+	return r;
+}
 
 /**
- * Gets the pointer to the current packet in the queue
- * 
- * @brief	Reads a packet from a pktqueue_t
+ * Schedules the next CoDel drop interval/sqrt(count) after t
+ *
+ * @brief	CoDel control law
+ * @param	c CoDel state
+ * @param	t Time of the last drop
+ * @param	next Time of the next drop (output)
+ *
+ */
+static void codel_law(codel_t *c, struct timeval *t, struct timeval *next) {
+	long usecs = (long)c->interval*1024/isqrt((unsigned long)c->count << 20);
+	struct timeval delta = { usecs/1000000, usecs%1000000 };
+
+	timeradd(t, &delta, next);
+}
+
+/**
+ * Sets up CoDel on a queue. The parameters are its target and interval in
+ * usecs, separated by a comma; interval should be a worst case RTT and
+ * target 5 to 10% of it, but not below the time a packet takes to depart.
+ *
+ * @brief	Initializes the CoDel state of a pktqueue_t
  * @param	p Queue
- * @return	Read packet
+ * @param	params "<target>,<interval>", NULL for CODEL_TARGET and CODEL_INTERVAL
  *
  */
-packet_t * read_packet(pktqueue_t *p)
-{
-	if(isempty(p)){
-		do_debug("\n%s: Queue underflow??\n", p->Qname);
-		return NULL;
+static void codel_init(pktqueue_t *p, char *params) {
+	codel_t *c = &p->codel;
+
+	memset(c, 0, sizeof(*c));
+	c->target = CODEL_TARGET;
+	c->interval = CODEL_INTERVAL;
+	if (params != NULL) sscanf(params, "%d,%d", &c->target, &c->interval);
+	c->maxpacket = PKT_MEDIUM;
+	do_debug("%s: CoDel target=%d interval=%d\n", p->Qname, c->target, c->interval);
+}
+
+/**
+ * Tells if the front packet has sat above target long enough to drop it:
+ * its sojourn time, from ptimein, has been above target for an interval,
+ * and the queue holds more than a packet
+ *
+ * @brief	CoDel drop condition
+ * @param	c CoDel state
+ * @param	backlog Bytes of the queue
+ * @param	d Descriptor of the front packet
+ * @param	now Current time
+ * @return	1 if it can be dropped, 0 if not
+ *
+ */
+static int codel_above(codel_t *c, int backlog, pktdesc_t *d, struct timeval *now) {
+	struct timeval sojourn, delta;
+
+	c->maxpacket = max(c->maxpacket, d->length);
+	timersub(now, &d->ptimein, &sojourn);
+	if (sojourn.tv_sec*1000000 + sojourn.tv_usec < c->target || backlog <= c->maxpacket) {
+		timerclear(&c->first_above);
+		return 0;
 	}
-	else {
-		return (p->arr[p->front]);
+	if (!timerisset(&c->first_above)) {
+		delta.tv_sec = c->interval/1000000;
+		delta.tv_usec = c->interval%1000000;
+		timeradd(now, &delta, &c->first_above);
+		return 0;
+	}
+	return timercmp(now, &c->first_above, >=);
+}
+
+/**
+ * CoDel decision on the front packet of a queue (RFC 8289). In dropping
+ * state it drops at the times of the control law until the sojourn time
+ * goes below target; entering it again soon after leaving it, it resumes
+ * near the drop rate it had.
+ *
+ * @brief	CoDel decision
+ * @param	c CoDel state
+ * @param	backlog Bytes of the queue
+ * @param	d Descriptor of the front packet
+ * @param	now Current time
+ * @return	1 to drop the packet, 0 to let it depart
+ *
+ */
+static int codel_decide(codel_t *c, int backlog, pktdesc_t *d, struct timeval *now) {
+	struct timeval since;
+	int above = codel_above(c, backlog, d, now), delta;
+
+	if (c->dropping) {
+		if (!above) {
+			c->dropping = 0;
+			return 0;
+		}
+		if (timercmp(now, &c->drop_next, <)) return 0;
+		c->count++;
+		codel_law(c, &c->drop_next, &c->drop_next);
+		return 1;
 	}
+	if (!above) return 0;
+	c->dropping = 1;
+	// drops again soon after the last dropping state, at about its rate
+	delta = c->count - c->lastcount;
+	timersub(now, &c->drop_next, &since);
+	c->count = (delta > 1 && since.tv_sec*1000000 + since.tv_usec < 16L*c->interval) ? delta : 1;
+	codel_law(c, now, &c->drop_next);
+	c->lastcount = c->count;
+	return 1;
+}
 
+/**
+ * CoDel on the front packet of a pktqueue_t, see codel_decide
+ *
+ * @brief	CoDel departure
+ * @param	p Queue
+ * @param	d Descriptor of the front packet
+ * @param	now Current time
+ * @return	1 to drop the packet, 0 to let it depart
+ *
+ */
+static int codel_depart(pktqueue_t *p, pktdesc_t *d, struct timeval *now) {
+	return codel_decide(&p->codel, p->bfullness, d, now);
 }
 
 /**
- * Gets the pointer to the current packet_t in a pktqueue_t and updates it's data
- * 
- * @brief	Dequeue a packet from a pktqueue_t
+ * Sets up PIE on a queue. The parameters are its target delay, update
+ * period and burst allowance in usecs, separated by commas.
+ *
+ * @brief	Initializes the PIE state of a pktqueue_t
  * @param	p Queue
- * @return	Dequeued packet
+ * @param	params "<target>,<tupdate>,<max_burst>", NULL for PIE_TARGET, PIE_TUPDATE and PIE_MAXBURST
  *
  */
-packet_t * dequeue_packet(pktqueue_t *p) {
-    do_debug("%s: dequeue_packet\n", p->Qname);
-	if (isempty(p)) {
-		do_debug("\n%s: Queue Underflow\n",p->Qname);
-		return NULL;
+static void pie_init(pktqueue_t *p, char *params) {
+	pie_t *e = &p->pie;
+
+	memset(e, 0, sizeof(*e));
+	e->target = PIE_TARGET;
+	e->tupdate = PIE_TUPDATE;
+	e->max_burst = PIE_MAXBURST;
+	if (params != NULL) sscanf(params, "%d,%d,%d", &e->target, &e->tupdate, &e->max_burst);
+	e->burst_allowance = e->max_burst;
+	gettimeofday(&e->next_update, NULL);
+	do_debug("%s: PIE target=%d tupdate=%d max_burst=%d\n", p->Qname, e->target, e->tupdate, e->max_burst);
+}
+
+/**
+ * Estimates the delay of a queue: its segments times the usecs each one
+ * takes to depart, or without a drain rate the sojourn time of the front
+ * packet
+ *
+ * @brief	Queue delay for PIE
+ * @param	p Queue
+ * @param	now Current time
+ * @return	Delay in usecs
+ *
+ */
+static int pie_qdelay(pktqueue_t *p, struct timeval *now) {
+	struct timeval sojourn;
+
+	if (p->drain > 0) return min((long)p->segfullness*p->drain, INT_MAX);
+	if (p->fullness == 0) return 0;
+	timersub(now, &p->desc[(p->front + 1)%p->buffer_size].ptimein, &sojourn);
+	return sojourn.tv_sec*1000000 + sojourn.tv_usec;
+}
+
+/**
+ * Updates the PIE drop probability once every tupdate (RFC 8033): by
+ * alpha times the delay over target plus beta times the delay growth,
+ * in smaller steps the lower the probability is, decaying while the queue
+ * is empty. The burst allowance runs out meanwhile and is given back when
+ * the delay has stayed low with nothing to drop.
+ *
+ * @brief	PIE tick
+ * @param	p Queue
+ * @param	now Current time
+ *
+ */
+static void pie_tick(pktqueue_t *p, struct timeval *now) {
+	pie_t *e = &p->pie;
+	struct timeval delta = { e->tupdate/1000000, e->tupdate%1000000 };
+	int qdelay;
+	float adj;
+
+	if (timercmp(now, &e->next_update, <)) return;
+	timeradd(now, &delta, &e->next_update);
+	qdelay = pie_qdelay(p, now);
+	adj = (PIE_ALPHA*(qdelay - e->target) + PIE_BETA*(qdelay - e->qdelay_old))/1000000;
+	if (e->prob < 0.000001) adj /= 2048;
+	else if (e->prob < 0.00001) adj /= 512;
+	else if (e->prob < 0.0001) adj /= 128;
+	else if (e->prob < 0.001) adj /= 32;
+	else if (e->prob < 0.01) adj /= 8;
+	else if (e->prob < 0.1) adj /= 2;
+	// no leaps at high probabilities
+	if (e->prob >= 0.1 && adj > 0.02) adj = 0.02;
+	e->prob += adj;
+	if (qdelay == 0 && e->qdelay_old == 0) e->prob *= 0.98;
+	if (e->prob < 0) e->prob = 0;
+	else if (e->prob > 1) e->prob = 1;
+
+	e->burst_allowance = max(0, e->burst_allowance - e->tupdate);
+	if (e->prob == 0 && qdelay < e->target/2 && e->qdelay_old < e->target/2)
+		e->burst_allowance = e->max_burst;
+	e->qdelay_old = qdelay;
+}
+
+/**
+ * PIE decision on an arriving packet. Nothing is dropped during a burst
+ * allowance, while the delay is low and the probability moderate, or with
+ * a couple of packets queued. Otherwise drops are drawn with the drop
+ * probability, derandomized so they are neither too close nor too far.
+ *
+ * @brief	PIE arrival
+ * @param	p Queue
+ * @param	d Descriptor of the arriving packet
+ * @param	now Current time
+ * @return	1 to drop the packet, 0 to enqueue it
+ *
+ */
+static int pie_arrive(pktqueue_t *p, pktdesc_t *d __attribute__((unused)), struct timeval *now __attribute__((unused))) {
+	pie_t *e = &p->pie;
+
+	if (e->burst_allowance > 0) return 0;
+	if ((e->qdelay_old < e->target/2 && e->prob < 0.2) || p->bfullness <= 2*PKT_MEDIUM) return 0;
+	if (e->prob == 0) e->accu_prob = 0;
+	e->accu_prob += e->prob;
+	if (e->accu_prob < 0.85) return 0;
+	if (e->accu_prob < 8.5 && rand_r(&p->seed) >= e->prob*((float)RAND_MAX + 1)) return 0;
+	e->accu_prob = 0;
+	return 1;
+}
+
+/**
+ * Sets up RED on a queue. The parameters are its thresholds in average
+ * segments and the weight of the current fullness in the average (sfullness),
+ * separated by commas.
+ *
+ * @brief	Initializes the RED state of a pktqueue_t
+ * @param	p Queue
+ * @param	params "<min_th>,<max_th>,<weight>", NULL for RED_MIN_TH, RED_MAX_TH and the default weight
+ *
+ */
+static void red_init(pktqueue_t *p, char *params) {
+	red_t *r = &p->red;
+	struct timeval now, delta = { RED_INTERVAL/1000000, RED_INTERVAL%1000000 };
+
+	memset(r, 0, sizeof(*r));
+	r->min_th = RED_MIN_TH;
+	r->max_th = RED_MAX_TH;
+	r->max_p = RED_MAX_P;
+	r->count = -1;
+	if (params != NULL) sscanf(params, "%f,%f,%f", &r->min_th, &r->max_th, &p->weight);
+	r->max_th = max(r->max_th, r->min_th + 1);
+	gettimeofday(&now, NULL);
+	timeradd(&now, &delta, &r->next_adapt);
+	do_debug("%s: RED min_th=%.1f max_th=%.1f weight=%.3f\n", p->Qname, r->min_th, r->max_th, p->weight);
+}
+
+/**
+ * Adapts max_p every RED_INTERVAL (Adaptive RED): it grows additively
+ * while the average is above the middle of the thresholds and shrinks
+ * multiplicatively while it is below, from 0.01 to 0.5
+ *
+ * @brief	RED tick
+ * @param	p Queue
+ * @param	now Current time
+ *
+ */
+static void red_tick(pktqueue_t *p, struct timeval *now) {
+	red_t *r = &p->red;
+	struct timeval delta = { RED_INTERVAL/1000000, RED_INTERVAL%1000000 };
+	float span = r->max_th - r->min_th;
+
+	if (timercmp(now, &r->next_adapt, <)) return;
+	timeradd(now, &delta, &r->next_adapt);
+	if (p->sfullness > r->min_th + 0.6*span && r->max_p <= 0.5)
+		r->max_p += min(0.01, r->max_p/4);
+	else if (p->sfullness < r->min_th + 0.4*span && r->max_p >= 0.01)
+		r->max_p *= 0.9;
+}
+
+/**
+ * RED decision on an arriving packet, from the average fullness. The
+ * probability is raised with the packets enqueued since the last drop,
+ * so the drops come evenly spaced rather than in bursts that would hit
+ * many flows at once.
+ *
+ * @brief	RED arrival
+ * @param	p Queue
+ * @param	d Descriptor of the arriving packet
+ * @param	now Current time
+ * @return	1 to drop the packet, 0 to enqueue it
+ *
+ */
+static int red_arrive(pktqueue_t *p, pktdesc_t *d __attribute__((unused)), struct timeval *now __attribute__((unused))) {
+	red_t *r = &p->red;
+	float avg = p->sfullness, pb;
+
+	if (avg < r->min_th) {
+		r->count = -1;
+		return 0;
 	}
-	else {
-		p->front=(p->front + 1)%p->buffer_size;
-	 	p->fullness--;
-		p->sfullness = ewma(a, p->sfullness, p->fullness);
-        p->bfullness-=(p->arr[p->front])->length; 
-		print_queue(p, 'd'); 
-		return(p->arr[p->front]);
+	r->count++;
+	if (avg >= 2*r->max_th)
+		pb = 1;
+	else if (avg >= r->max_th)
+		pb = r->max_p + (1 - r->max_p)*(avg - r->max_th)/r->max_th;
+	else
+		pb = r->max_p*(avg - r->min_th)/(r->max_th - r->min_th);
+	pb = (r->count*pb < 1) ? pb/(1 - r->count*pb) : 1;
+	if (rand_r(&p->seed) >= pb*((float)RAND_MAX + 1)) return 0;
+	r->count = 0;
+	return 1;
+}
+
+/**
+ * Sets up FQ-CoDel on a queue. The parameters are the target and interval
+ * of the CoDel of every flow in usecs, the number of flow queues and the
+ * quantum in bytes, separated by commas. A priority band of the queue
+ * keeps taking the control packets ahead of the flows.
+ *
+ * @brief	Initializes the FQ-CoDel state of a pktqueue_t
+ * @param	p Queue, empty
+ * @param	params "<target>,<interval>,<flows>,<quantum>", NULL for CODEL_TARGET, CODEL_INTERVAL, FQ_FLOWS and FQ_QUANTUM
+ *
+ */
+static void fq_init(pktqueue_t *p, char *params) {
+	fq_t *fq;
+	int i, target, interval, nflows = FQ_FLOWS, quantum = FQ_QUANTUM;
+
+	codel_init(p, params);
+	if (params != NULL) sscanf(params, "%d,%d,%d,%d", &target, &interval, &nflows, &quantum);
+	fq = p->fq = (fq_t *) calloc(1, sizeof(fq_t));
+	for (fq->bits = 1; (1 << fq->bits) < nflows && fq->bits < 16; fq->bits++);
+	fq->nflows = 1 << fq->bits;
+	fq->quantum = max(quantum, QUEUE_CTLPKT);
+	fq->perturb = rand_r(&p->seed);
+	fq->flows = (fqflow_t *) malloc(fq->nflows*sizeof(fqflow_t));
+	for (i = 0; i < fq->nflows; i++) {
+		fq->flows[i].head = fq->flows[i].next = -1;
+		fq->flows[i].bytes = fq->flows[i].deficit = fq->flows[i].active = 0;
+		fq->flows[i].codel = p->codel;
+	}
+	fq->newflows.head = fq->oldflows.head = -1;
+	fq->desc = (pktdesc_t *) malloc(p->buffer_size*sizeof(pktdesc_t));
+	fq->next = (int *) malloc(p->buffer_size*sizeof(int));
+	for (i = 0; i < p->buffer_size; i++) fq->next[i] = i + 1;
+	fq->next[p->buffer_size - 1] = -1;
+	fq->freeslot = 0;
+	do_debug("%s: FQ-CoDel flows=%d quantum=%d\n", p->Qname, fq->nflows, fq->quantum);
+}
+
+/**
+ * Flow queue of a flow hash, salted so that the flows colliding are not
+ * the same on every run
+ *
+ * @brief	Flow queue of a packet
+ * @param	fq FQ-CoDel state
+ * @param	hash Flow hash of the packet
+ * @return	Index of the flow queue
+ *
+ */
+static inline int fq_flow(fq_t *fq, uint32_t hash) {
+	return ((hash ^ fq->perturb)*0x9e3779b1u) >> (32 - fq->bits);
+}
+
+/**
+ * Appends a flow to a list of flows
+ *
+ * @brief	Appends to a fqlist_t
+ * @param	fq FQ-CoDel state
+ * @param	l List
+ * @param	i Index of the flow
+ *
+ */
+static void fq_append(fq_t *fq, fqlist_t *l, int i) {
+	fq->flows[i].next = -1;
+	if (l->head < 0) l->head = i;
+	else fq->flows[l->tail].next = i;
+	l->tail = i;
+}
+
+/**
+ * Removes the first flow of a list of flows
+ *
+ * @brief	Removes the head of a fqlist_t
+ * @param	fq FQ-CoDel state
+ * @param	l List, not empty
+ * @return	Index of the flow
+ *
+ */
+static int fq_shift(fq_t *fq, fqlist_t *l) {
+	int i = l->head;
+
+	l->head = fq->flows[i].next;
+	return i;
+}
+
+/**
+ * Puts a packet at the end of its flow queue in a free slot. A flow that
+ * was not active joins the new flows with a quantum to send.
+ *
+ * @brief	Enqueues a packet in its flow
+ * @param	p Queue with FQ-CoDel and a free slot
+ * @param	d Descriptor of the packet
+ *
+ */
+static void fq_add(pktqueue_t *p, pktdesc_t *d) {
+	fq_t *fq = p->fq;
+	int i = fq_flow(fq, d->hash), slot = fq->freeslot;
+	fqflow_t *f = &fq->flows[i];
+
+	fq->freeslot = fq->next[slot];
+	fq->desc[slot] = *d;
+	fq->next[slot] = -1;
+	if (f->head < 0) f->head = slot;
+	else fq->next[f->tail] = slot;
+	f->tail = slot;
+	f->bytes += d->length;
+	if (!f->active) {
+		f->active = 1;
+		f->deficit = fq->quantum;
+		fq_append(fq, &fq->newflows, i);
 	}
 }
 
+/**
+ * Takes the first packet out of a flow queue, freeing its slot
+ *
+ * @brief	Dequeues a packet from its flow
+ * @param	fq FQ-CoDel state
+ * @param	f Flow, not empty
+ * @param	d Descriptor of the packet (output)
+ *
+ */
+static void fq_pop(fq_t *fq, fqflow_t *f, pktdesc_t *d) {
+	int slot = f->head;
+
+	*d = fq->desc[slot];
+	f->head = fq->next[slot];
+	f->bytes -= d->length;
+	fq->next[slot] = fq->freeslot;
+	fq->freeslot = slot;
+}
+
+/**
+ * Drops the first packet of a flow queue from the pktqueue_t
+ *
+ * @brief	Drops a packet of a flow
+ * @param	p Queue with FQ-CoDel
+ * @param	f Flow, not empty
+ * @return	Length of the dropped packet
+ *
+ */
+static int fq_discard(pktqueue_t *p, fqflow_t *f) {
+	pktdesc_t d;
+
+	fq_pop(p->fq, f, &d);
+	p->fullness--;
+	p->bfullness -= d.length;
+	p->segfullness -= d.segs;
+	if (p->share != NULL) __atomic_sub_fetch(&p->share->used, d.length, __ATOMIC_RELAXED);
+	p->release(d.pkt);
+	return d.length;
+}
+
+/**
+ * Makes room in a queue with FQ-CoDel that refuses a packet: the flow
+ * holding the most bytes loses packets from its head, up to half of its
+ * bytes or FQ_DROPBATCH packets, so the scan of the flows is paid once for
+ * many drops. The caller counts the first of them.
+ *
+ * @brief	Drops from the fattest flow
+ * @param	p Queue with FQ-CoDel
+ * @param	why Drop reason
+ * @return	Bytes dropped, 0 if no packet waits in a flow
+ *
+ */
+static int fq_drop(pktqueue_t *p, int why) {
+	fq_t *fq = p->fq;
+	fqflow_t *f = NULL;
+	int i, k, bytes = 0;
+
+	for (i = fq->newflows.head; i >= 0; i = fq->flows[i].next)
+		if (f == NULL || fq->flows[i].bytes > f->bytes) f = &fq->flows[i];
+	for (i = fq->oldflows.head; i >= 0; i = fq->flows[i].next)
+		if (f == NULL || fq->flows[i].bytes > f->bytes) f = &fq->flows[i];
+	if (f == NULL || f->head < 0) return 0;
+	for (k = 0; k < FQ_DROPBATCH && f->head >= 0 && bytes < f->bytes; k++)
+		bytes += fq_discard(p, f);
+	p->drops[why] += k - 1;
+	return bytes;
+}
 
+/**
+ * Schedules the next packet of a queue with FQ-CoDel (RFC 8290): the
+ * first of the new flows, or else of the old flows, with deficit left
+ * sends its head packet once CoDel has dropped (or marked) the ones that
+ * sat too long; a flow out of deficit gets a quantum and goes to the end
+ * of the old flows. An empty new flow becomes old, so it gets no second
+ * boost before the old ones are served, and an empty old flow leaves.
+ * The packet moves to the circular buffer of the queue.
+ *
+ * @brief	Schedules a packet of FQ-CoDel
+ * @param	p Queue with FQ-CoDel
+ * @param	now Current time
+ * @return	1 if a packet was scheduled, 0 if the flows are empty
+ *
+ */
+static int fq_stage(pktqueue_t *p, struct timeval *now) {
+	fq_t *fq = p->fq;
+	fqlist_t *l;
+	fqflow_t *f;
+	int i;
+
+	for (;;) {
+		if (fq->newflows.head >= 0) l = &fq->newflows;
+		else if (fq->oldflows.head >= 0) l = &fq->oldflows;
+		else return 0;
+		f = &fq->flows[l->head];
+		if (f->deficit <= 0) {
+			f->deficit += fq->quantum;
+			fq_append(fq, &fq->oldflows, fq_shift(fq, l));
+			continue;
+		}
+		while (f->head >= 0 && codel_decide(&f->codel, f->bytes, &fq->desc[f->head], now)) {
+			if (p->aqm_mark) {
+				p->signals++;
+				break;
+			}
+			p->drops[DROP_AQM]++;
+			fq_discard(p, f);
+		}
+		if (f->head < 0) {
+			i = fq_shift(fq, l);
+			if (l == &fq->newflows && fq->oldflows.head >= 0) fq_append(fq, &fq->oldflows, i);
+			else f->active = 0;
+			continue;
+		}
+		p->rear = (p->rear + 1)%p->buffer_size;
+		fq_pop(fq, f, &p->desc[p->rear]);
+		f->deficit -= p->desc[p->rear].length;
+		return 1;
+	}
+}
+
+static const aqm_t aqms[] = {
+	{ "codel", codel_init, NULL, codel_depart, NULL },
+	{ "pie", pie_init, pie_arrive, NULL, pie_tick },
+	{ "red", red_init, red_arrive, NULL, red_tick },
+	{ "fq_codel", fq_init, NULL, NULL, NULL },
+	{ NULL, NULL, NULL, NULL, NULL }
+};
+
+/**
+ * Looks an AQM up by name: codel, pie, red or fq_codel
+ *
+ * @brief	Finds an AQM
+ * @param	name Name of the AQM
+ * @return	The AQM, NULL if there is none by that name
+ *
+ */
+const aqm_t *aqm_find(char *name) {
+	const aqm_t *m;
+
+	for (m = aqms; m->name != NULL; m++)
+		if (strcmp(m->name, name) == 0) return m;
+	return NULL;
+}
+
+/**
+ * Puts a pktqueue_t under active queue management. The packets the AQM
+ * drops are freed with the release function of the drop policy, so it
+ * must be called after queue_policy. When the packets are marked instead,
+ * they are kept and the owner of the queue reacts to queue_signal. A
+ * priority band is left alone.
+ *
+ * @brief	Sets the AQM of a pktqueue_t
+ * @param	p Queue
+ * @param	aqm AQM, see aqm_find
+ * @param	params Parameters of the AQM, NULL for its defaults
+ * @param	mark Signal congestion instead of dropping
+ *
+ */
+void queue_aqm(pktqueue_t *p, const aqm_t *aqm, char *params, int mark) {
+	p->aqm = aqm;
+	p->aqm_params = params;
+	p->aqm_mark = mark;
+	p->signals = 0;
+	aqm->init(p, params);
+	do_debug("%s: %s AQM%s\n", p->Qname, aqm->name, mark ? " (marking)" : "");
+}
+
+/**
+ * Tells if the AQM of a queue marking packets, or of one of its traffic
+ * classes, signalled congestion since the last call
+ *
+ * @brief	Takes the congestion signals of a pktqueue_t
+ * @param	p Queue
+ * @return	1 if it signalled congestion, 0 if not
+ *
+ */
+int queue_signal(pktqueue_t *p) {
+	int i, signalled = p->signals > 0;
+
+	for (i = 0; i < p->nclasses; i++)
+		signalled |= queue_signal(&p->classes[i].q);
+	p->signals = 0;
+	return signalled;
+}
+
+/**
+ * Tells a pktqueue_t how fast it drains, so its delay can be estimated
+ * from its backlog
+ *
+ * @brief	Sets the drain rate of a pktqueue_t
+ * @param	p Queue
+ * @param	usecs Usecs a segment takes to depart, 0 if not known
+ *
+ */
+void queue_drain(pktqueue_t *p, int usecs) {
+	p->drain = usecs;
+}
+
+/**
+ * Lets the AQM of a queue drop packets from its front before one departs,
+ * or mark it
+ *
+ * @brief	Applies the AQM to the front of a pktqueue_t
+ * @param	p Queue with an AQM
+ * @param	now Current time
+ * @return	1 if a packet is left to depart, 0 if the queue ran empty
+ *
+ */
+static int aqm_depart(pktqueue_t *p, struct timeval *now) {
+	while (p->fullness > 0 && p->aqm->depart(p, &p->desc[(p->front + 1)%p->buffer_size], now)) {
+		if (p->aqm_mark) {
+			p->signals++;
+			break;
+		}
+		p->drops[DROP_AQM]++;
+		queue_evict(p, 0);
+	}
+	return p->fullness > 0;
+}
+
+/**
+ * Adjusts a dynamic byte limit at a pacing tick of the queue, once its
+ * departures are done. If the queue ran empty while the limit refused
+ * packets, it was too low and grows by the refused bytes. Otherwise the
+ * lowest backlog seen in QUEUE_SLACK_HOLD usecs never drained, it is
+ * standing queue, and the limit shrinks by that much. The AQM of the
+ * queue gets its tick too. With traffic classes, every class gets its tick.
+ *
+ * @brief	Updates the dynamic byte limit and the AQM of a pktqueue_t
+ * @param	p Queue
+ *
+ */
+void queue_tick(pktqueue_t *p) {
+	struct timeval now, hold;
+	int i;
+
+	if (p->classes != NULL) {
+		for (i = 0; i < p->nclasses; i++) queue_tick(&p->classes[i].q);
+		return;
+	}
+	if (p->blimit_max == 0 && (p->aqm == NULL || p->aqm->tick == NULL)) return;
+	gettimeofday(&now, NULL);
+	if (p->aqm != NULL && p->aqm->tick != NULL) p->aqm->tick(p, &now);
+	if (p->blimit_max == 0) return;
+	p->slack = min(p->slack, p->bfullness);
+	if (p->bfullness == 0 && p->overlimit > 0) {
+		// starved
+		p->blimit += p->overlimit;
+		p->slack = INT_MAX;
+		p->slack_start = now;
+	} else {
+		hold.tv_sec = QUEUE_SLACK_HOLD/1000000;
+		hold.tv_usec = QUEUE_SLACK_HOLD%1000000;
+		timeradd(&p->slack_start, &hold, &hold);
+		if (timercmp(&now, &hold, >=)) {
+			p->blimit -= p->slack;
+			p->slack = INT_MAX;
+			p->slack_start = now;
+		}
+	}
+	p->blimit = max(PKT_MEDIUM, min(p->blimit, p->blimit_max));
+	p->overlimit = 0;
+}
+
+/**
+ * Initializes a buffer shared by queues, all of it free
+ *
+ * @brief	Initializes a bufshare_t
+ * @param	b bufshare_t to initialize
+ * @param	size Bytes of the buffer
+ * @param	alpha Threshold of a queue as a fraction of the free bytes
+ *
+ */
+void share_init(bufshare_t *b, long size, float alpha) {
+	b->size = size;
+	b->used = 0;
+	b->alpha = alpha;
+	do_debug("Initializing shared buffer: size=%ld, alpha=%.2f\n", size, alpha);
+}
+
+/**
+ * Makes a pktqueue_t take its packets from a shared buffer. The queues of
+ * a buffer can belong to different threads.
+ *
+ * @brief	Attaches a pktqueue_t to a bufshare_t
+ * @param	p Queue, empty
+ * @param	b Shared buffer
+ *
+ */
+void queue_share(pktqueue_t *p, bufshare_t *b) {
+	p->share = b;
+}
+
+/**
+ * Packets a queue can hold, in its slots and in those of its priority
+ * band and traffic classes
+ *
+ * @brief	Slots of a pktqueue_t
+ * @param	p Queue
+ * @return	Number of packets
+ *
+ */
+int queue_slots(pktqueue_t *p) {
+	int i, n = p->buffer_size + (p->prio != NULL ? p->prio->buffer_size : 0);
+
+	for (i = 0; i < p->nclasses; i++) n += queue_slots(&p->classes[i].q);
+	return n;
+}
+
+/**
+ * Bytes a queue can hold before refusing packets in its shared buffer:
+ * alpha times the free bytes of the buffer
+ *
+ * @brief	Dynamic threshold of a pktqueue_t
+ * @param	p Queue
+ * @return	Threshold in bytes, -1 if the queue has no shared buffer
+ *
+ */
+int queue_threshold(pktqueue_t *p) {
+	if (p->share == NULL) return -1;
+	return p->share->alpha*max(0, p->share->size - __atomic_load_n(&p->share->used, __ATOMIC_RELAXED));
+}
+
+/**
+ * Reads a field of a traffic class rule, a decimal number with nothing
+ * after it
+ *
+ * @brief	Parses a number of a classrule_t
+ * @param	val Field
+ * @param	max Largest value
+ * @return	The number, -1 if val is not a number up to max
+ *
+ */
+static int class_number(char *val, int max) {
+	char *end;
+	long v;
+
+	if (*val < '0' || *val > '9') return -1;
+	v = strtol(val, &end, 10);
+	return (*end == '\0' && v <= max) ? (int)v : -1;
+}
+
+/**
+ * Reads a traffic class rule: a match, dscp:<dscp>, proto:<tcp|udp|icmp|
+ * number> or port:<port>[-<port>], then optionally the weight of the class
+ * and its quantum in bytes, separated by commas
+ *
+ * @brief	Parses a classrule_t
+ * @param	r Rule (output)
+ * @param	spec "<match>[,<weight>[,<quantum>]]"
+ * @return	0, -1 if spec is not a rule
+ *
+ */
+int class_parse(classrule_t *r, char *spec) {
+	char key[8], val[16], *hi;
+	int n = 0;
+
+	r->dscp = r->proto = r->porthi = -1;
+	r->portlo = 0;
+	r->weight = 1;
+	r->quantum = 0;
+	if (sscanf(spec, "%7[a-z]:%15[^,]%n", key, val, &n) < 2) return -1;
+	if (spec[n] == ',') sscanf(spec + n + 1, "%d,%d", &r->weight, &r->quantum);
+	if (strcmp(key, "dscp") == 0) {
+		if ((r->dscp = class_number(val, 63)) < 0) return -1;
+	} else if (strcmp(key, "proto") == 0) {
+		if (strcmp(val, "tcp") == 0) r->proto = IPPROTO_TCP;
+		else if (strcmp(val, "udp") == 0) r->proto = IPPROTO_UDP;
+		else if (strcmp(val, "icmp") == 0) r->proto = IPPROTO_ICMP;
+		else if ((r->proto = class_number(val, 255)) < 0) return -1;
+	} else if (strcmp(key, "port") == 0) {
+		if ((hi = strchr(val, '-')) != NULL) *hi++ = '\0';
+		r->portlo = class_number(val, 65535);
+		r->porthi = hi != NULL ? class_number(hi, 65535) : r->portlo;
+		if (r->portlo < 0 || r->porthi < r->portlo) return -1;
+	} else {
+		return -1;
+	}
+	return r->weight > 0 && r->quantum >= 0 ? 0 : -1;
+}
+
+_Static_assert(CLASS_MAX < 10, "the index of a class must be a single digit");
+
+/**
+ * Splits a pktqueue_t into traffic classes, the rules given plus a default
+ * class of weight 1, served by deficit round robin: in its turn a class
+ * sends its quantum of bytes, and what it sends over is taken from its
+ * next turn. Each class is a queue with the setup of p (byte limit, shared
+ * buffer, drop policy, priority band and AQM), so it must be called last.
+ * The priority band of p goes to the classes: each class has one, and the
+ * slots of its own.
+ *
+ * @brief	Adds traffic classes to a pktqueue_t
+ * @param	p Queue, empty
+ * @param	rules Rules of the classes, see class_parse
+ * @param	n Number of rules, up to CLASS_MAX
+ *
+ */
+void queue_classes(pktqueue_t *p, classrule_t *rules, int n) {
+	trafclass_t *c;
+	char Qname[10];
+	int i;
+
+	p->nclasses = n + 1;
+	p->classes = (trafclass_t *) malloc(p->nclasses*sizeof(trafclass_t));
+	for (i = 0; i < p->nclasses; i++) {
+		c = &p->classes[i];
+		if (i < n) {
+			c->rule = rules[i];
+		} else {
+			c->rule.dscp = c->rule.proto = c->rule.porthi = -1;
+			c->rule.portlo = c->rule.quantum = 0;
+			c->rule.weight = 1;
+		}
+		// a single digit, see the assertion on CLASS_MAX
+		snprintf(Qname, sizeof(Qname), "%.7s/%c", p->Qname, '0' + i);
+		queue_init(&c->q, p->buffer_size, Qname);
+		c->q.weight = p->weight;
+		if (p->blimit > 0) queue_limit(&c->q, p->blimit_max > 0 ? p->blimit_max : p->blimit, p->blimit_max > 0);
+		c->q.share = p->share;
+		queue_policy(&c->q, p->policy, p->release);
+		c->q.drain = p->drain;
+		if (p->prio != NULL) queue_prio(&c->q, p->prio_cap);
+		if (p->aqm != NULL) queue_aqm(&c->q, p->aqm, p->aqm_params, p->aqm_mark);
+		c->quantum = c->rule.quantum > 0 ? c->rule.quantum : c->rule.weight*CLASS_QUANTUM;
+		c->deficit = c->quantum;
+		c->pkts = c->bytes = 0;
+		do_debug("%s: class dscp=%d proto=%d ports=%d-%d quantum=%d\n", Qname,
+					c->rule.dscp, c->rule.proto, c->rule.portlo, c->rule.porthi, c->quantum);
+	}
+	// the classes account their packets in the shared buffer and band
+	p->share = NULL;
+	if (p->prio != NULL) {
+		free(p->prio->desc);
+		free(p->prio);
+		p->prio = NULL;
+	}
+	p->cls_cur = 0;
+}
+
+/**
+ * Prints the counters of the traffic classes of a queue
+ *
+ * @brief	Prints the traffic classes of a pktqueue_t
+ * @param	p Queue
+ *
+ */
+void print_classes(pktqueue_t *p) {
+	trafclass_t *c;
+	int i;
+
+	if (!debug) return;
+	for (i = 0; i < p->nclasses; i++) {
+		c = &p->classes[i];
+		do_debug("%s: sent %lu packets, %lu bytes, fullness=%d, deficit=%d, drops=%lu/%lu/%lu/%lu\n",
+					c->q.Qname, c->pkts, c->bytes, c->q.fullness, c->deficit,
+					c->q.drops[DROP_OVERFLOW], c->q.drops[DROP_OVERLIMIT], c->q.drops[DROP_THRESHOLD], c->q.drops[DROP_AQM]);
+	}
+}
+
+/**
+ * Finds the traffic class of a packet: the first one whose rule it matches
+ *
+ * @brief	Classifies a packet
+ * @param	p Queue with traffic classes
+ * @param	pkt Packet
+ * @return	Index of the class
+ *
+ */
+static int class_of(pktqueue_t *p, packet_t *pkt) {
+	classrule_t *r;
+	uint16_t l4off, payoff, ports[2];
+	uint8_t proto;
+	int i;
+
+	getFlowHash(pkt->data, pkt->length, &proto, &l4off, &payoff);
+	for (i = 0; i < p->nclasses - 1; i++) {
+		r = &p->classes[i].rule;
+		if (r->dscp >= 0 && getDSCP(pkt->data) != r->dscp) continue;
+		if (r->proto >= 0 && proto != r->proto && !(r->proto == IPPROTO_ICMP && proto == IPPROTO_ICMPV6)) continue;
+		if (r->porthi >= 0) {
+			// the ports are right after the transport header starts
+			if ((proto != IPPROTO_TCP && proto != IPPROTO_UDP) || payoff <= l4off) continue;
+			memcpy(ports, pkt->data + l4off, sizeof(ports));
+			if ((ntohs(ports[0]) < r->portlo || ntohs(ports[0]) > r->porthi) &&
+					(ntohs(ports[1]) < r->portlo || ntohs(ports[1]) > r->porthi))
+				continue;
+		}
+		return i;
+	}
+	return i;
+}
+
+/**
+ * Counts the packets, bytes and segments of a traffic class with its
+ * priority band
+ *
+ * @brief	Fullness of a traffic class
+ * @param	q Queue of the class
+ * @param	f Packets, bytes and segments (output)
+ *
+ */
+static void class_fullness(pktqueue_t *q, int f[3]) {
+	f[0] = q->fullness;
+	f[1] = q->bfullness;
+	f[2] = q->segfullness;
+	if (q->prio != NULL) {
+		f[0] += q->prio->fullness;
+		f[1] += q->prio->bfullness;
+		f[2] += q->prio->segfullness;
+	}
+}
+
+/**
+ * Enqueues packets in the traffic classes of a queue, each run of packets
+ * of the same class at once, every class taking packets as its own slots
+ * and limits allow. The counters of the queue follow those of its classes.
+ *
+ * @brief	Enqueues a batch of packets in their classes
+ * @param	p Queue with traffic classes
+ * @param	pkts Packets to enqueue
+ * @param	n Number of packets
+ * @return	Number of enqueued packets, now the first ones of pkts
+ *
+ */
+static int class_enqueue(pktqueue_t *p, packet_t **pkts, int n) {
+	trafclass_t *c;
+	packet_t *pkt;
+	int i, k, j, x, cur, next, acc = 0, before[3], after[3];
+
+	next = n > 0 ? class_of(p, pkts[0]) : 0;
+	for (i = 0; i < n; i += k) {
+		cur = next;
+		for (k = 1; i + k < n && (next = class_of(p, pkts[i + k])) == cur; k++);
+		c = &p->classes[cur];
+		class_fullness(&c->q, before);
+		j = enqueue_batch(&c->q, pkts + i, k);
+		class_fullness(&c->q, after);
+		p->fullness += after[0] - before[0];
+		p->bfullness += after[1] - before[1];
+		p->segfullness += after[2] - before[2];
+		// the enqueued packets join the ones enqueued before them
+		for (x = 0; x < j; x++) {
+			pkt = pkts[acc + x];
+			pkts[acc + x] = pkts[i + x];
+			pkts[i + x] = pkt;
+		}
+		acc += j;
+	}
+	p->sfullness = ewma(p->weight, p->sfullness, p->segfullness);
+	print_queue(p, 'e');
+	return acc;
+}
+
+/**
+ * Schedules the next packet of a queue with traffic classes by deficit
+ * round robin: the class whose turn it is sends its next packet if it has
+ * deficit left, else the turn goes to the next class, which gets its
+ * quantum. The packet moves to the circular buffer of the queue with its
+ * descriptor, so its enqueue time is still the one it arrived at.
+ *
+ * @brief	Schedules a packet of the traffic classes
+ * @param	p Queue with traffic classes
+ * @return	1 if a packet was scheduled, 0 if the classes are empty
+ *
+ */
+static int class_stage(pktqueue_t *p) {
+	trafclass_t *c;
+	pktqueue_t *q;
+	packet_t *pkt;
+	int got, before[3], after[3], staged = (p->rear - p->front + p->buffer_size)%p->buffer_size;
+
+	while (p->fullness > staged) {
+		c = &p->classes[p->cls_cur];
+		class_fullness(&c->q, before);
+		if (before[0] == 0 || c->deficit <= 0) {
+			if (before[0] == 0) c->deficit = 0;
+			p->cls_cur = (p->cls_cur + 1)%p->nclasses;
+			p->classes[p->cls_cur].deficit += p->classes[p->cls_cur].quantum;
+			continue;
+		}
+		got = dequeue_batch(&c->q, &pkt, 1, NULL);
+		// the packets its AQM dropped leave the counters
+		class_fullness(&c->q, after);
+		p->fullness -= before[0] - after[0] - got;
+		p->bfullness -= before[1] - after[1] - (got ? pkt->length : 0);
+		p->segfullness -= before[2] - after[2] - (got ? pkt->segs : 0);
+		if (!got) continue;
+		c->deficit -= pkt->length;
+		c->pkts++;
+		c->bytes += pkt->length;
+		// its descriptor stays in the slot it departed from, in the class or its band
+		q = (c->q.prio != NULL && c->q.prio->desc[c->q.prio->front].pkt == pkt) ? c->q.prio : &c->q;
+		p->rear = (p->rear + 1)%p->buffer_size;
+		p->desc[p->rear] = q->desc[q->front];
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Schedules packets of a queue with traffic classes or FQ-CoDel until n
+ * of them wait in its circular buffer, if it has as many and the buffer
+ * has room for them
+ *
+ * @brief	Fills the departures of a pktqueue_t
+ * @param	p Queue with traffic classes or FQ-CoDel
+ * @param	n Packets wanted
+ * @return	Packets scheduled, at most n
+ *
+ */
+static int queue_schedule(pktqueue_t *p, int n) {
+	struct timeval now;
+	int staged = (p->rear - p->front + p->buffer_size)%p->buffer_size;
+
+	n = min(n, p->buffer_size - 1);
+	if (staged < n) {
+		gettimeofday(&now, NULL);
+		while (staged < n && (p->classes != NULL ? class_stage(p) : fq_stage(p, &now))) staged++;
+	}
+	return min(n, staged);
+}
+
+/**
+ * Enqueues up to n packets in a pktqueue_t, in order, and updates its
+ * shared buffer once for all of them. When the queue refuses a packet (no
+ * slot left, over its byte limit or over its shared buffer threshold) its
+ * drop policy either drops queued packets until it fits or stops there.
+ * The packets the AQM drops on arrival are moved behind the enqueued ones.
+ * Control packets go to the priority band of the queue, if it has one.
+ * With FQ-CoDel, packets go to their flow queues and a refused packet
+ * makes the fattest flow drop instead of the drop policy. With traffic
+ * classes, packets go to the queues of their classes.
+ * The header of the next packet is prefetched while a descriptor is filled.
+ * 
+ * @brief	Enqueues a batch of packet_t
+ * @param	p Queue to enqueue the packets
+ * @param	pkts Packets to enqueue
+ * @param	n Number of packets
+ * @return	Number of enqueued packets, now the first ones of pkts
+ * 
+ */
+int enqueue_batch(pktqueue_t *p, packet_t **pkts, int n) {
+	struct timeval now;
+	pktqueue_t *q = p;
+	pktdesc_t d;
+	packet_t *pkt;
+	int i, j = 0, t, v = -1, why = -1, bytes = 0, evicted = 0, threshold = queue_threshold(p);
+
+    do_debug("%s: enqueue_batch %d\n", p->Qname, n);
+	if (p->classes != NULL) return class_enqueue(p, pkts, n);
+	gettimeofday(&now, NULL);
+	for (i = 0; i < n; i++) {
+		if (i + 1 < n) __builtin_prefetch(pkts[i + 1]->data);
+		desc_fill(&d, pkts[i], &now);
+		if (p->prio != NULL)
+			q = CheckControlPacket(pkts[i]->data, d.proto, d.l4off, d.payoff) ? p->prio : p;
+		if (q == p && p->aqm != NULL && p->aqm->arrive != NULL && p->aqm->arrive(p, &d, &now)) {
+			if (p->aqm_mark) {
+				p->signals++;
+			} else {
+				// left behind the enqueued packets
+				p->drops[DROP_AQM]++;
+				continue;
+			}
+		}
+		while ((why = queue_refuses(q, d.length, threshold)) >= 0) {
+			q->drops[why]++;
+			if (q->fq == NULL && (q->fullness == 0 || (v = q->policy->victim(q)) < 0)) break;
+			// the shared buffer is settled before giving bytes back to it
+			if (p->share != NULL) __atomic_add_fetch(&p->share->used, bytes, __ATOMIC_RELAXED);
+			bytes = 0;
+			if ((t = q->fq != NULL ? fq_drop(q, why) : queue_evict(q, v)) == 0) break;
+			if (why == DROP_OVERLIMIT) q->overlimit += t;
+			threshold = queue_threshold(p);
+			evicted++;
+		}
+		if (why >= 0) break;
+		if (q->fq != NULL) {
+			fq_add(q, &d);
+		} else {
+			q->rear = (q->rear+1)%q->buffer_size;
+			q->desc[q->rear] = d;
+		}
+		q->fullness++;
+		q->bfullness += d.length;
+		q->segfullness += d.segs;
+		bytes += d.length;
+		pkt = pkts[j];
+		pkts[j++] = pkts[i];
+		pkts[i] = pkt;
+	}
+	if (why >= 0) {
+		do_debug("\n%s: Packet refused, %s\n", q->Qname, drop_reasons[why]);
+		// the rest of the batch is refused with it
+		q->drops[why] += n - i - 1;
+		if (why == DROP_OVERLIMIT)
+			for (t = i; t < n; t++) q->overlimit += pkts[t]->length;
+	}
+	if (j == 0 && evicted == 0) return 0;
+	if (p->share != NULL) __atomic_add_fetch(&p->share->used, bytes, __ATOMIC_RELAXED);
+	p->sfullness = ewma(p->weight, p->sfullness, p->segfullness);
+	print_queue(p, 'e'); 
+	if (p->prio != NULL) {
+		p->prio->sfullness = ewma(p->prio->weight, p->prio->sfullness, p->prio->segfullness);
+		print_queue(p->prio, 'e');
+	}
+	return j;
+}
+
+/**
+ * Enqueues a packet_t in a pktqueue_t and updates it's data
+ * 
+ * @brief	Enqueues a packet_t
+ * @param	p Queue to enqueue the packet
+ * @param	pkt Packet to enqueue
+ * @return	1 if it succeeded 0 if it didn't
+ * 
+ */
+int enqueue_packet(pktqueue_t *p, packet_t *pkt) {
+	return enqueue_batch(p, &pkt, 1);
+}
+
+
+/**
+ * Gets the pointer to the packet at the front of the queue, the one the next
+ * dequeue_packet returns, without dequeuing it
+ * 
+ * @brief	Reads a packet from a pktqueue_t
+ * @param	p Queue
+ * @return	Read packet
+ *
+ */
+packet_t * read_packet(pktqueue_t *p)
+{
+	if (p->prio != NULL || p->fq != NULL || p->classes != NULL) {
+		pktdesc_t *d = read_desc(p, 0);
+		return d ? d->pkt : NULL;
+	}
+	if(isempty(p)){
+		do_debug("\n%s: Queue underflow??\n", p->Qname);
+		return NULL;
+	}
+	else {
+		return (p->desc[(p->front + 1)%p->buffer_size].pkt);
+	}
+
+}
+
+/**
+ * Gets the descriptor of the i-th packet from the front of the queue, the
+ * one read_packet returns being the 0th. With a priority band, the i-th
+ * packet to depart from either band. With FQ-CoDel or traffic classes,
+ * the packets are scheduled as they are read, the AQM dropping from their
+ * flows or classes meanwhile.
+ *
+ * @brief	Reads a packet descriptor from a pktqueue_t
+ * @param	p Queue
+ * @param	i Position from the front
+ * @return	Descriptor, NULL if there are not as many packets
+ *
+ */
+pktdesc_t *read_desc(pktqueue_t *p, int i)
+{
+	pktqueue_t *q;
+	int ip, ib, k, run;
+
+	if (p->classes != NULL || (p->fq != NULL && p->prio == NULL)) {
+		if (i < 0 || queue_schedule(p, i + 1) <= i) return NULL;
+		return &p->desc[(p->front + 1 + i)%p->buffer_size];
+	}
+	if (p->prio != NULL && i >= 0) {
+		run = p->prio_run;
+		for (ip = ib = 0; (q = band_next(p, ip, ib, &run)) != NULL; ) {
+			k = (q == p) ? ib++ : ip++;
+			if (i-- > 0) continue;
+			if (q == p && p->fq != NULL && queue_schedule(p, k + 1) <= k) return NULL;
+			return &q->desc[(q->front + 1 + k)%q->buffer_size];
+		}
+		return NULL;
+	}
+	if (i < 0 || i >= p->fullness) return NULL;
+	return &p->desc[(p->front + 1 + i)%p->buffer_size];
+}
+
+/**
+ * Tells whether the departure time of a paced dequeue has come
+ *
+ * @brief	Departure time check of a pace_t
+ * @param	pace Limits, NULL if none
+ * @return	1 if the next packet can depart, 0 if not yet
+ *
+ */
+static inline int pace_due(pace_t *pace) {
+	return pace == NULL || !timercmp(&pace->now, &pace->depart, <);
+}
+
+/**
+ * Counts the packet of a descriptor in a paced dequeue if it fits in the
+ * byte budget, and moves the next departure behind its segments
+ *
+ * @brief	Takes a departure into a pace_t
+ * @param	pace Limits, NULL if none
+ * @param	d Descriptor of the departing packet
+ * @return	1 if the packet departs, 0 if it does not fit
+ *
+ */
+static int pace_take(pace_t *pace, pktdesc_t *d) {
+	if (pace == NULL) return 1;
+	if (pace->bytes > 0 && pace->bytes + pace->overhead + d->length > pace->budget) return 0;
+	pace->bytes += pace->overhead + d->length;
+	pace->depart.tv_usec += d->segs*pace->usecs;
+	pace->depart.tv_sec += pace->depart.tv_usec/1000000;
+	pace->depart.tv_usec %= 1000000;
+	return 1;
+}
+
+/**
+ * Dequeues up to n packets from a pktqueue_t one at a time, in departure
+ * order from it and its priority band (see band_next), the AQM deciding
+ * on every packet of the queue before it departs and the limits on the
+ * packet that departs
+ *
+ * @brief	Dequeues a batch of packets one by one
+ * @param	p Queue with a priority band or an AQM
+ * @param	pkts Dequeued packets
+ * @param	n Most packets to dequeue
+ * @param	pace Departure limits, NULL if none
+ * @return	Number of dequeued packets
+ *
+ */
+static int dequeue_each(pktqueue_t *p, packet_t **pkts, int n, pace_t *pace) {
+	struct timeval now;
+	pktqueue_t *q;
+	pktdesc_t *d;
+	int i = 0, run = p->prio_run;
+
+	if (p->aqm != NULL && p->aqm->depart != NULL) gettimeofday(&now, NULL);
+	while (i < n && pace_due(pace) && (q = band_next(p, 0, 0, &run)) != NULL) {
+		// the AQM can drop the front packets instead, the next one departs
+		if (q == p && p->aqm != NULL && p->aqm->depart != NULL && !aqm_depart(p, &now))
+			continue;
+		// or FQ-CoDel from its flows
+		if (q == p && p->fq != NULL && queue_schedule(p, 1) == 0)
+			continue;
+		d = &q->desc[(q->front + 1)%q->buffer_size];
+		if (!pace_take(pace, d)) break;
+		p->prio_run = run;
+		q->front = (q->front + 1)%q->buffer_size;
+		__builtin_prefetch(d->pkt->hdr);
+		pkts[i++] = d->pkt;
+		q->fullness--;
+		q->bfullness -= d->length;
+		q->segfullness -= d->segs;
+		if (q->share != NULL) __atomic_sub_fetch(&q->share->used, d->length, __ATOMIC_RELAXED);
+	}
+	if (i == 0) return 0;
+	p->sfullness = ewma(p->weight, p->sfullness, p->segfullness);
+	print_queue(p, 'd');
+	if (p->prio != NULL) {
+		p->prio->sfullness = ewma(p->prio->weight, p->prio->sfullness, p->prio->segfullness);
+		print_queue(p->prio, 'd');
+	}
+	return i;
+}
+
+/**
+ * Dequeues up to n packets from the front of a pktqueue_t and updates its
+ * data once for all of them. The descriptors further on and the header of
+ * every dequeued packet are prefetched for the caller. With a priority
+ * band, packets are taken from both bands in departure order. Packets
+ * dropped by the AQM are replaced by the ones behind them. With FQ-CoDel
+ * or traffic classes, the flows or classes are scheduled first. With
+ * pace, dequeuing stops at the first packet that is not due yet or does
+ * not fit in the byte budget, so the packets counted are the ones taken.
+ * 
+ * @brief	Dequeues a batch of packets from a pktqueue_t
+ * @param	p Queue
+ * @param	pkts Dequeued packets
+ * @param	n Most packets to dequeue
+ * @param	pace Departure limits, updated, NULL if none
+ * @return	Number of dequeued packets
+ *
+ */
+int dequeue_batch(pktqueue_t *p, packet_t **pkts, int n, pace_t *pace) {
+	pktdesc_t *d;
+	int i, bytes = 0, segs = 0;
+
+    do_debug("%s: dequeue_batch %d\n", p->Qname, n);
+	if (p->classes != NULL || (p->fq != NULL && p->prio == NULL)) n = queue_schedule(p, n);
+	else if (p->prio != NULL || p->aqm != NULL) return dequeue_each(p, pkts, n, pace);
+	if (isempty(p)) {
+		do_debug("\n%s: Queue Underflow\n",p->Qname);
+		return 0;
+	}
+	if ((n = min(n, p->fullness)) <= 0) return 0;
+	for (i = 0; i < n; i++) {
+		d = &p->desc[(p->front + 1)%p->buffer_size];
+		if (!pace_due(pace) || !pace_take(pace, d)) break;
+		p->front=(p->front + 1)%p->buffer_size;
+		if (i + QUEUE_PREFETCH < n)
+			__builtin_prefetch(&p->desc[(p->front + QUEUE_PREFETCH)%p->buffer_size]);
+		__builtin_prefetch(d->pkt->hdr);
+		pkts[i] = d->pkt;
+		bytes += d->length;
+		segs += d->segs;
+	}
+	if ((n = i) == 0) return 0;
+	if (p->share != NULL) __atomic_sub_fetch(&p->share->used, bytes, __ATOMIC_RELAXED);
+ 	p->fullness -= n;
+    p->bfullness -= bytes; 
+	p->segfullness -= segs;
+	p->sfullness = ewma(p->weight, p->sfullness, p->segfullness);
+	print_queue(p, 'd'); 
+	return n;
+}
+
+/**
+ * Gets the pointer to the current packet_t in a pktqueue_t and updates it's data
+ * 
+ * @brief	Dequeue a packet from a pktqueue_t
+ * @param	p Queue
+ * @return	Dequeued packet
+ *
+ */
+packet_t * dequeue_packet(pktqueue_t *p) {
+	packet_t *pkt;
+
+	if (dequeue_batch(p, &pkt, 1, NULL) == 0) return NULL;
+	return pkt;
+}
+
+
+/**
+ * Number of packets in a pktring_t, from either side
+ *
+ * @brief	Fullness of a pktring_t
+ * @param	r Ring
+ * @return	Packets in the ring
+ *
+ */
+int ring_fullness(pktring_t *r) {
+	return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Bytes of the packets in a pktring_t, from either side
+ *
+ * @brief	Fullness of a pktring_t in bytes
+ * @param	r Ring
+ * @return	Bytes in the ring
+ *
+ */
+int ring_bfullness(pktring_t *r) {
+	return __atomic_load_n(&r->bytes_in, __ATOMIC_RELAXED) - __atomic_load_n(&r->bytes_out, __ATOMIC_RELAXED);
+}
+
+/**
+ * MSS segments of the packets in a pktring_t, from either side
+ *
+ * @brief	Fullness of a pktring_t in MSS segments
+ * @param	r Ring
+ * @return	Segments in the ring
+ *
+ */
+int ring_segfullness(pktring_t *r) {
+	return __atomic_load_n(&r->segs_in, __ATOMIC_RELAXED) - __atomic_load_n(&r->segs_out, __ATOMIC_RELAXED);
+}
+
+/**
+ * Prints the current state of the ring as print_queue does
+ *
+ * @brief	Prints the current state of the ring
+ * @param	r Ring
+ * @param	ev Event printed with the state
+ *
+ */
+void print_ring(pktring_t *r, char ev) {
+	struct timeval now;
+
+	if (!debug) return;
+	gettimeofday(&now, NULL);
+	do_debug("%s %c (%ld.%.6ld): buffer_size=%u, head=%u, tail=%u, fullness=%d, sfullness=%.2f, bfullness=%d, segfullness=%d\n",
+				r->Qname, ev, now.tv_sec, now.tv_usec, r->mask + 1, r->head, r->tail, ring_fullness(r),
+				r->sfullness, ring_bfullness(r), ring_segfullness(r));
+}
+
+/**
+ * Initializes a pktring_t, its size rounded up to a power of two
+ *
+ * @brief	Initializes a pktring_t
+ * @param	r pktring_t to initialize
+ * @param	ringsize Desired size of the ring
+ * @param	Qname Desired name of the ring
+ *
+ */
+void ring_init(pktring_t *r, int ringsize, char *Qname) {
+	uint32_t size = 1;
+
+	while (size < (uint32_t)ringsize) size <<= 1;
+	memset(r, 0, sizeof(*r));
+	strncpy(r->Qname, Qname, sizeof(r->Qname) - 1);
+	r->mask = size - 1;
+	r->weight = a;
+	r->desc = (pktdesc_t *) malloc(size*sizeof(pktdesc_t));
+	if (r->desc == NULL) {
+		perror("Allocating packet ring");
+		exit(1);
+	}
+	do_debug("Initializing packet ring %s\n", r->Qname);
+	print_ring(r, 'i');
+}
+
+/**
+ * Enqueues a packet_t in a pktring_t. Only the producer thread calls it.
+ *
+ * @brief	Enqueues a packet_t in a pktring_t
+ * @param	r Ring to enqueue the packet
+ * @param	pkt Packet to enqueue
+ * @return	1 if it succeeded 0 if the ring is full
+ *
+ */
+int ring_enqueue(pktring_t *r, packet_t *pkt) {
+	uint32_t tail = r->tail;
+	struct timeval now;
+
+	do_debug("%s: ring_enqueue\n", r->Qname);
+	if (tail - r->head_cache > r->mask) {
+		// looks full, see how far the consumer got
+		r->head_cache = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if (tail - r->head_cache > r->mask) {
+			do_debug("\n%s: Ring Overflow\n", r->Qname);
+			return 0;
+		}
+	}
+	gettimeofday(&now, NULL);
+	desc_fill(&r->desc[tail & r->mask], pkt, &now);
+	__atomic_store_n(&r->bytes_in, r->bytes_in + pkt->length, __ATOMIC_RELAXED);
+	__atomic_store_n(&r->segs_in, r->segs_in + pkt->segs, __ATOMIC_RELAXED);
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	r->sfullness = ewma(r->weight, r->sfullness, ring_segfullness(r));
+	print_ring(r, 'e');
+	return 1;
+}
+
+/**
+ * Gets the packet the next ring_dequeue returns without dequeuing it. Only
+ * the consumer thread calls it.
+ *
+ * @brief	Reads a packet from a pktring_t
+ * @param	r Ring
+ * @return	Read packet, NULL if the ring is empty
+ *
+ */
+packet_t *ring_peek(pktring_t *r) {
+	uint32_t head = r->head;
+
+	if (head == r->tail_cache) {
+		r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		if (head == r->tail_cache) return NULL;
+	}
+	return r->desc[head & r->mask].pkt;
+}
+
+/**
+ * Dequeues the packet at the head of a pktring_t, handing its slot back to
+ * the producer. Only the consumer thread calls it.
+ *
+ * @brief	Dequeues a packet from a pktring_t
+ * @param	r Ring
+ * @return	Dequeued packet, NULL if the ring is empty
+ *
+ */
+packet_t *ring_dequeue(pktring_t *r) {
+	packet_t *pkt;
+	pktdesc_t *d;
+
+	do_debug("%s: ring_dequeue\n", r->Qname);
+	if ((pkt = ring_peek(r)) == NULL) {
+		do_debug("\n%s: Ring Underflow\n", r->Qname);
+		return NULL;
+	}
+	d = &r->desc[r->head & r->mask];
+	__atomic_store_n(&r->bytes_out, r->bytes_out + d->length, __ATOMIC_RELAXED);
+	__atomic_store_n(&r->segs_out, r->segs_out + d->segs, __ATOMIC_RELAXED);
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+	print_ring(r, 'd');
+	return pkt;
+}
+
+/**
+ * Prints the state of the pool: capacity, packets in use, high-water mark
+ * and how many times it was found exhausted
+ *
+ * @brief	Prints the current state of the pool
+ * @param	p Packet pool
+ *
+ */
+void print_pool(pktpool_t *p) {
+	static const char *pages[] = { "normal", "thp", "hugetlb" };
+
+	do_debug("%s: capacity=%d, inuse=%d, highwater=%d, exhausted=%lu, arena=%zu (%s)\n",
+				p->name, p->capacity, p->capacity - p->nfree, p->highwater, p->exhausted,
+				p->arealen, pages[p->pages]);
+}
+
+/**
+ * Maps the arena of a pool. Reserved hugepages are tried first with
+ * POOL_PAGES_HUGETLB; without them (or with POOL_PAGES_THP) a hugepage
+ * aligned anonymous mapping is advised to use transparent hugepages. The
+ * arena is then locked, which faults every page in; if it cannot be locked
+ * it is touched instead.
+ *
+ * @brief	Maps, prefaults and locks the arena of a pktpool_t
+ * @param	p pktpool_t whose arealen is set
+ * @param	pages Desired pages (POOL_PAGES_*)
+ *
+ */
+static void pool_map(pktpool_t *p, int pages) {
+	uint8_t *map;
+	size_t head;
+
+	p->arealen = (p->arealen + POOL_HUGEPAGE - 1) & ~(POOL_HUGEPAGE - 1);
+	p->pages = pages;
+	p->area = MAP_FAILED;
+	if (pages == POOL_PAGES_HUGETLB) {
+		p->area = mmap(NULL, p->arealen, PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p->area == MAP_FAILED) {
+			do_debug("%s: no hugepages reserved, trying transparent hugepages\n", p->name);
+			p->pages = POOL_PAGES_THP;
+		}
+	}
+	if (p->area == MAP_FAILED) {
+		// map a hugepage more to align the arena on a hugepage
+		map = mmap(NULL, p->arealen + POOL_HUGEPAGE, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (map == MAP_FAILED) {
+			perror("Mapping packet pool");
+			exit(1);
+		}
+		head = (POOL_HUGEPAGE - (uintptr_t)map%POOL_HUGEPAGE)%POOL_HUGEPAGE;
+		if (head > 0) munmap(map, head);
+		munmap(map + head + p->arealen, POOL_HUGEPAGE - head);
+		p->area = map + head;
+		if (p->pages == POOL_PAGES_THP && madvise(p->area, p->arealen, MADV_HUGEPAGE) < 0) {
+			do_debug("%s: transparent hugepages not available\n", p->name);
+			p->pages = POOL_PAGES_NORMAL;
+		}
+	}
+	if (mlock(p->area, p->arealen) < 0) {
+		perror("Locking packet pool");
+		memset(p->area, 0, p->arealen);
+	}
+}
+
+/**
+ * Allocates every packet of a pktpool_t at once (plus its drop packet) in
+ * an arena backed by the desired pages, all of them free
+ *
+ * @brief	Initializes a pktpool_t
+ * @param	p pktpool_t to initialize
+ * @param	capacity Number of packets
+ * @param	pktsize Allocation size of a packet
+ * @param	name Desired name of the pool
+ * @param	pages Pages backing the arena (POOL_PAGES_*)
+ *
+ */
+void pool_init(pktpool_t *p, int capacity, size_t pktsize, char *name, int pages) {
+	int i;
+
+	strncpy(p->name, name, sizeof(p->name) - 1);
+	p->name[sizeof(p->name) - 1] = '\0';
+	// keep every packet aligned for its timeval
+	p->pktsize = (pktsize + 7) & ~(size_t)7;
+	p->capacity = capacity;
+	p->arealen = (size_t)(capacity + 1)*p->pktsize;
+	pool_map(p, pages);
+	p->free = (packet_t **) malloc(capacity*sizeof(packet_t *));
+	if (p->free == NULL) {
+		perror("Allocating packet pool");
+		exit(1);
+	}
+	for (i = 0; i < capacity; i++)
+		p->free[i] = (packet_t *) (p->area + (size_t)(capacity - 1 - i)*p->pktsize);
+	p->nfree = capacity;
+	p->drop = (packet_t *) (p->area + (size_t)capacity*p->pktsize);
+	p->highwater = 0;
+	p->exhausted = 0;
+	do_debug("Initializing packet pool %s\n", p->name);
+	print_pool(p);
+}
+
+/**
+ * Takes a free packet from the pool. If there is none, the drop packet is
+ * returned and the exhaustion counted: the caller reads into it and
+ * discards it.
+ *
+ * @brief	Gets a packet from a pktpool_t
+ * @param	p Pool
+ * @return	Free packet, or p->drop if the pool is exhausted
+ *
+ */
+packet_t *pool_get(pktpool_t *p) {
+	if (p->nfree == 0) {
+		p->exhausted++;
+		do_debug("\n%s: Pool exhausted\n", p->name);
+		print_pool(p);
+		return p->drop;
+	}
+	p->nfree--;
+	if (p->capacity - p->nfree > p->highwater) p->highwater = p->capacity - p->nfree;
+	return p->free[p->nfree];
+}
+
+/**
+ * Gives a packet back to the pool it was taken from
+ *
+ * @brief	Puts a packet back in a pktpool_t
+ * @param	p Pool
+ * @param	pkt Packet to put back (the drop packet is ignored)
+ *
+ */
+void pool_put(pktpool_t *p, packet_t *pkt) {
+	if (pkt == p->drop) return;
+	p->free[p->nfree++] = pkt;
+}
+
+/**
+ * Initializes a pool per size class: small and medium packets for every
+ * packet the worker can hold, and large ones, which hold anything, for
+ * fewer of them. Receiving always lands in a large packet that is moved to
+ * the smallest class it fits in, so a queued pure ACK takes PKT_SMALL
+ * bytes of data rather than a whole MTU.
+ *
+ * @brief	Initializes the size classed pools of a worker
+ * @param	pools PKT_CLASSES pktpool_t, smallest class first
+ * @param	capacity Number of small and of medium packets
+ * @param	large Number of large packets
+ * @param	name Desired name of the pools, a class letter is appended
+ * @param	pages Pages backing the arenas (POOL_PAGES_*)
+ *
+ */
+void pools_init(pktpool_t *pools, int capacity, int large, char *name, int pages) {
+	static const int room[PKT_CLASSES] = { PKT_SMALL, PKT_MEDIUM, PKT_LARGE };
+	char cname[10];
+	int i;
+
+	for (i = 0; i < PKT_CLASSES; i++) {
+		snprintf(cname, sizeof(cname), "%s/%c", name, "sml"[i]);
+		pool_init(&pools[i], i == PKT_CLASSES - 1 ? large : capacity,
+					offsetof(packet_t, data) + room[i], cname, pages);
+	}
+}
+
+/**
+ * Checks if a packet (or the drop packet) belongs to a pool
+ *
+ * @brief	Checks if a packet is in a pktpool_t
+ * @param	p Pool
+ * @param	pkt Packet
+ * @return	1 if true 0 if false
+ *
+ */
+int pool_owns(pktpool_t *p, packet_t *pkt) {
+	return (uint8_t *)pkt >= p->area && (uint8_t *)pkt < p->area + p->arealen;
+}
+
+/**
+ * @brief	Bytes of data a packet of a pool can hold
+ * @param	p Pool
+ * @return	Room for data of its packets
+ *
+ */
+static inline int pool_room(pktpool_t *p) {
+	return p->pktsize - offsetof(packet_t, data);
+}
+
+/**
+ * Takes a packet of the smallest size class with room for len bytes of
+ * data. An exhausted class is counted and a larger one is tried.
+ *
+ * @brief	Gets a packet for a length from size classed pools
+ * @param	pools PKT_CLASSES pktpool_t
+ * @param	len Bytes of data
+ * @return	Free packet, or POOL_DROP(pools) if every class it fits is exhausted
+ *
+ */
+packet_t *pool_get_fit(pktpool_t *pools, int len) {
+	int i;
+
+	for (i = 0; i < PKT_CLASSES - 1; i++) {
+		if (len > pool_room(&pools[i])) continue;
+		if (pools[i].nfree > 0) return pool_get(&pools[i]);
+		pools[i].exhausted++;
+	}
+	return pool_get(&pools[PKT_CLASSES - 1]);
+}
+
+/**
+ * Moves a received packet to the smallest size class it fits in, copying
+ * its header (hdrlen bytes before data) and data to a packet of that
+ * class. The caller keeps pkt to receive again if a copy is returned.
+ * An exhausted class is counted and a larger one is tried.
+ *
+ * @brief	Fits a packet in its size class
+ * @param	pools PKT_CLASSES pktpool_t
+ * @param	pkt Received packet, length and segs set
+ * @param	hdrlen Length of the header before data
+ * @return	The copy, or pkt if it is in the smallest class available
+ *
+ */
+packet_t *pool_fit(pktpool_t *pools, packet_t *pkt, int hdrlen) {
+	packet_t *copy;
+	int i;
+
+	for (i = 0; i < PKT_CLASSES; i++) {
+		if (pool_owns(&pools[i], pkt)) return pkt;
+		if (pkt->length > pool_room(&pools[i])) continue;
+		if (pools[i].nfree == 0) {
+			pools[i].exhausted++;
+			continue;
+		}
+		copy = pool_get(&pools[i]);
+		memcpy((char *)copy->data - hdrlen, (char *)pkt->data - hdrlen, hdrlen + pkt->length);
+		copy->length = pkt->length;
+		copy->segs = pkt->segs;
+		return copy;
+	}
+	return pkt;
+}
+
+/**
+ * Gives a packet back to the size class it was taken from
+ *
+ * @brief	Puts a packet back in size classed pools
+ * @param	pools PKT_CLASSES pktpool_t
+ * @param	pkt Packet to put back
+ *
+ */
+void pool_release(pktpool_t *pools, packet_t *pkt) {
+	int i;
+
+	for (i = 0; i < PKT_CLASSES; i++) {
+		if (pool_owns(&pools[i], pkt)) {
+			pool_put(&pools[i], pkt);
+			return;
+		}
+	}
+}
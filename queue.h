@@ -7,43 +7,449 @@
  *
  */
 #include <stdint.h>
+#include <stddef.h>
+#include <sys/time.h>
+#include <linux/virtio_net.h>
 
 #undef max
 #define max(x,y) ((x) > (y) ? (x) : (y))
 #undef min
 #define min(x,y) ((x) < (y) ? (x) : (y))
 
+#define PKT_MAXLEN 65535	/**< largest packet, a GSO super-packet of 64 KB */
+#define PKT_HDRROOM 16		/**< room for the header carried before data */
+
+#define QUEUE_PREFETCH	4		/**< descriptors prefetched ahead by dequeue_batch */
+#define QUEUE_SLACK_HOLD	1000000	/**< usecs a dynamic byte limit must see slack before shrinking */
+#define QUEUE_CTLPKT	40		/**< smallest control packet (IPv4 and TCP headers) */
+#define QUEUE_WEIGHT	0.5		/**< default weight of the current fullness in sfullness */
+
+#define PKT_CLASSES	3			/**< size classes of the packets */
+#define PKT_SMALL	128			/**< data of a small packet (pure ACKs, control) */
+#define PKT_MEDIUM	2048		/**< data of a medium packet (up to a 1500 MTU) */
+#define PKT_LARGE	PKT_MAXLEN	/**< data of a large packet (GSO, jumbo frames) */
+
+#define DROP_OVERFLOW	0	/**< drop reason: no slot left */
+#define DROP_OVERLIMIT	1	/**< drop reason: over the byte limit */
+#define DROP_THRESHOLD	2	/**< drop reason: over the shared buffer threshold */
+#define DROP_AQM		3	/**< drop reason: dropped by the AQM */
+#define DROP_REASONS	4	/**< number of drop reasons */
+
+#define CODEL_TARGET	5000	/**< usecs of standing queue delay CoDel aims at */
+#define CODEL_INTERVAL	100000	/**< usecs the delay must stay above target for CoDel to act */
+#define PIE_TARGET		15000	/**< usecs of queue delay PIE aims at */
+#define PIE_TUPDATE		15000	/**< usecs between updates of the PIE drop probability */
+#define PIE_MAXBURST	150000	/**< usecs of burst PIE lets through after a quiet time */
+#define PIE_ALPHA		0.125	/**< PIE probability per second of delay over target */
+#define PIE_BETA		1.25	/**< PIE probability per second of delay growth */
+#define RED_MIN_TH		10		/**< average segments RED starts dropping at */
+#define RED_MAX_TH		30		/**< average segments RED drops max_p of the packets at */
+#define RED_MAX_P		0.1		/**< initial max_p of RED */
+#define RED_INTERVAL	500000	/**< usecs between adaptations of max_p */
+#define FQ_FLOWS		1024	/**< flow queues of FQ-CoDel (power of 2) */
+#define FQ_QUANTUM		1514	/**< bytes a flow of FQ-CoDel sends per round */
+#define FQ_DROPBATCH	64		/**< most packets dropped at once from the fattest flow */
+#define CLASS_MAX		8		/**< most traffic classes of a queue, besides the default one */
+#define CLASS_QUANTUM	1514	/**< bytes a traffic class of weight 1 sends per round */
+
+#define RING_CACHELINE 64	/**< size of a cache line */
+
+#define POOL_HUGEPAGE (2UL << 20)	/**< size of a hugepage */
+#define POOL_PAGES_NORMAL	0	/**< pool arena in regular pages */
+#define POOL_PAGES_THP		1	/**< pool arena in transparent hugepages */
+#define POOL_PAGES_HUGETLB	2	/**< pool arena in reserved hugepages (THP if none left) */
+
 /**
- * Packet structure of 1500 bytes maximum with timing support and length control
+ * Packet structure of PKT_MAXLEN bytes maximum with length control. What
+ * the queues need to know about a queued packet is kept in its pktdesc_t,
+ * so the packet itself is only touched to read or write it. A header read and written together with the packet (the
+ * virtio-net header with IFF_VNET_HDR, the ethernet header in wire mode)
+ * is stored in hdr, right before data, so both go in a single buffer.
+ * Packets are allocated up to a shorter data in size classes, see pools_init.
  *
- * @brief	Packet structure with timing support
+ * @brief	Packet structure
  */
 typedef struct packet_t {
     int  length;				/**< length of the packet */
-	struct timeval ptimein;		/**< timeval structure used for unenqueuing */
-	uint8_t data[1500];			/**< pointer to the actual packet data */
+	int segs;					/**< number of MSS segments (1 if not GSO) */
+	uint8_t hdr[PKT_HDRROOM];	/**< header ending right before data */
+	uint8_t data[PKT_MAXLEN];	/**< pointer to the actual packet data */
 } packet_t;
 
+/** virtio-net header (GSO metadata) of a packet read with IFF_VNET_HDR */
+#define PKT_VNET(p) ((struct virtio_net_hdr *)((p)->data - sizeof(struct virtio_net_hdr)))
+
 
 /**
- * Circular buffer of packet_t structures
+ * Descriptor of a queued packet, filled when it is enqueued. Queues keep
+ * their descriptors contiguous and the payloads in the pool, so scanning
+ * the metadata of a queue (sojourn times, byte counts, flows) runs over
+ * packed descriptors instead of a cache line and a page per packet.
  *
- * @brief	packet_t circular buffer
+ * @brief	Queued packet metadata
+ */
+typedef struct {
+	packet_t *pkt;				/**< the packet (payload) */
+	struct timeval ptimein;		/**< time it was enqueued */
+	int length;					/**< length of the packet */
+	int segs;					/**< number of MSS segments */
+	uint32_t hash;				/**< flow hash of its 5-tuple, 0 if not IP */
+	uint8_t proto;				/**< transport protocol */
+	uint16_t l4off;				/**< offset of the transport header in data */
+	uint16_t payoff;			/**< offset of the transport payload in data */
+} pktdesc_t;
+
+/**
+ * Buffer shared by the queues of the process, accounted in bytes. Each
+ * queue takes packets only while it holds less than alpha times the free
+ * buffer (dynamic threshold), so a bursting queue borrows what the idle
+ * ones leave and the threshold drops as the buffer fills, keeping room
+ * for the others.
+ *
+ * @brief	Shared buffer with dynamic thresholds
+ */
+typedef struct {
+	long size;		/**< bytes of the buffer */
+	long used;		/**< bytes held by all the queues */
+	float alpha;	/**< threshold as a fraction of the free bytes */
+} bufshare_t;
+
+struct pktqueue;
+
+/**
+ * What a queue drops when it refuses a packet. victim picks the packet to
+ * drop: a queued one, counted from the front, so the arriving packet takes
+ * its place, or -1 for the arriving packet itself.
+ *
+ * @brief	Drop policy of a pktqueue_t
+ */
+typedef struct {
+	const char *name;						/**< name of the policy */
+	int (*victim)(struct pktqueue *p);		/**< packet to drop, -1 for the arriving one */
+} droppolicy_t;
+
+/**
+ * Active queue management of a queue: decides from the descriptors which
+ * packets to drop (or to mark, see queue_aqm) when they arrive or when
+ * they reach the front to depart.
+ *
+ * @brief	AQM of a pktqueue_t
+ */
+typedef struct {
+	const char *name;	/**< name of the AQM */
+	void (*init)(struct pktqueue *p, char *params);	/**< sets up its state, params can be NULL */
+	int (*arrive)(struct pktqueue *p, pktdesc_t *d, struct timeval *now);	/**< 1 to drop an arriving packet, can be NULL */
+	int (*depart)(struct pktqueue *p, pktdesc_t *d, struct timeval *now);	/**< 1 to drop the front packet, can be NULL */
+	void (*tick)(struct pktqueue *p, struct timeval *now);	/**< runs at every queue_tick, can be NULL */
+} aqm_t;
+
+/**
+ * CoDel (RFC 8289) keeps the standing queue delay near target: once the
+ * sojourn time of the departing packets has been above target for an
+ * interval, it drops one and then drops more often, at interval/sqrt(count)
+ * spacing, until the sojourn time goes below target.
+ *
+ * @brief	CoDel state of a pktqueue_t
+ */
+typedef struct {
+	int target;						/**< usecs of acceptable standing delay */
+	int interval;					/**< usecs of the sliding window (a worst case RTT) */
+	struct timeval first_above;		/**< when the delay will have been above target for an interval, 0 if below */
+	struct timeval drop_next;		/**< time of the next drop while dropping */
+	int count;						/**< drops since dropping started */
+	int lastcount;					/**< count of the last dropping state */
+	int dropping;					/**< in dropping state */
+	int maxpacket;					/**< largest packet seen */
+} codel_t;
+
+/**
+ * PIE (RFC 8033) drops arriving packets with a probability it updates every
+ * tupdate from the queue delay, estimated from the backlog and the drain
+ * rate of the queue: it grows with the delay over target and with its
+ * growth since the last update. Bursts pass untouched for max_burst after
+ * the queue has been quiet.
+ *
+ * @brief	PIE state of a pktqueue_t
+ */
+typedef struct {
+	int target;						/**< usecs of queue delay aimed at */
+	int tupdate;					/**< usecs between updates of prob */
+	int max_burst;					/**< usecs of burst allowance */
+	float prob;						/**< drop probability */
+	float accu_prob;				/**< probability accumulated since the last drop */
+	int qdelay_old;					/**< queue delay at the last update, in usecs */
+	int burst_allowance;			/**< usecs left of burst allowance */
+	struct timeval next_update;		/**< time of the next update of prob */
+} pie_t;
+
+/**
+ * Adaptive RED drops arriving packets with a probability growing from 0
+ * to max_p as the average fullness (sfullness) goes from min_th to max_th
+ * segments, and on to 1 at twice max_th (gentle RED). max_p adapts every
+ * RED_INTERVAL to keep the average in the middle of the thresholds.
+ *
+ * @brief	RED state of a pktqueue_t
+ */
+typedef struct {
+	float min_th;					/**< average segments the drops start at */
+	float max_th;					/**< average segments the drop probability reaches max_p at */
+	float max_p;					/**< drop probability at max_th */
+	int count;						/**< packets enqueued since the last drop, -1 below min_th */
+	struct timeval next_adapt;		/**< time of the next adaptation of max_p */
+} red_t;
+
+/**
+ * A flow of FQ-CoDel: its packets, chained in the slots of the fq_t, and
+ * its place in the round of the scheduler
+ *
+ * @brief	Flow queue of FQ-CoDel
+ */
+typedef struct {
+	int head;						/**< slot of its first packet, -1 if empty */
+	int tail;						/**< slot of its last packet */
+	int bytes;						/**< bytes queued */
+	int deficit;					/**< bytes it can still send in this round */
+	int active;						/**< in the list of new or old flows */
+	int next;						/**< next flow of its list, -1 if last */
+	codel_t codel;					/**< CoDel state of the flow */
+} fqflow_t;
+
+/**
+ * List of flows of FQ-CoDel, chained by their next
+ *
+ * @brief	List of fqflow_t
+ */
+typedef struct {
+	int head;						/**< first flow, -1 if empty */
+	int tail;						/**< last flow */
+} fqlist_t;
+
+/**
+ * FQ-CoDel (RFC 8290) hashes the packets of a queue into flow queues on
+ * their 5-tuple and serves the flows by deficit round robin, the flows
+ * that just became active (new) before the others (old), each flow under
+ * CoDel of its own. A bulk flow then only delays itself and sparse flows
+ * (interactive traffic, ACKs, DNS) go through almost without queueing.
+ * The flows take their packets from as many slots as the queue has, so
+ * the memory is bounded whatever the number of flows.
+ *
+ * @brief	FQ-CoDel state of a pktqueue_t
  */
 typedef struct {
-	packet_t **arr;
+	int nflows;						/**< flow queues (power of 2) */
+	int bits;						/**< log2 of nflows */
+	int quantum;					/**< bytes a flow sends per round */
+	uint32_t perturb;				/**< salt of the flow hash */
+	fqflow_t *flows;				/**< the flow queues */
+	fqlist_t newflows;				/**< flows that just became active */
+	fqlist_t oldflows;				/**< flows that used up a quantum */
+	pktdesc_t *desc;				/**< slots of the packets in the flows */
+	int *next;						/**< next packet of the flow or next free slot of every slot */
+	int freeslot;					/**< first free slot, -1 if none */
+} fq_t;
+
+/**
+ * What a traffic class takes and its share of the link. A packet belongs
+ * to the first class it matches on every field set, the default class
+ * (none set) taking the rest.
+ *
+ * @brief	Traffic class rule
+ */
+typedef struct {
+	int dscp;						/**< DSCP matched, -1 for any */
+	int proto;						/**< transport protocol matched (icmp covers ICMPv6), -1 for any */
+	int portlo;						/**< lowest port matched, source or destination */
+	int porthi;						/**< highest port matched, -1 for any */
+	int weight;						/**< share of the link against the other classes */
+	int quantum;					/**< bytes sent per round, 0 for weight times CLASS_QUANTUM */
+} classrule_t;
+
+struct trafclass;
+
+/**
+ * Circular buffer of packet_t structures. Besides its slots, it can be
+ * limited in bytes, a limit that can follow the drain of the queue as BQL
+ * does: it grows when the queue runs empty after refusing packets, and
+ * shrinks by the backlog that never drained for QUEUE_SLACK_HOLD usecs.
+ * Which packet goes when the queue refuses one is up to its drop policy.
+ * Control packets can get a priority band, a pktqueue_t of its own served
+ * first; the counters of the queue are those of the bulk packets. An AQM
+ * can drop its packets earlier, see queue_aqm. With FQ-CoDel the packets
+ * wait in their flow queues and the circular buffer only holds the ones
+ * already scheduled to depart; the counters are those of all the packets.
+ * Traffic classes work the same way, each class being a pktqueue_t.
+ *
+ * @brief	packet_t circular buffer
+ */
+typedef struct pktqueue {
+	pktdesc_t *desc;	/**< descriptors of the slots */
 	char Qname[10];		/**< name of the queue */
 	long buffer_size;	/**< size of the queue */
 	int rear;			/**< rear position */
 	int front;			/**< front position */
 	int fullness;		/**< fullnes in number of packets */
-	float sfullness;	/**< smooth fullness of packets */
+	float sfullness;	/**< smooth fullness of segments */
+	float weight;		/**< weight of the current fullness in sfullness */
     int bfullness;		/**< fullness in bytes */
+	int segfullness;	/**< fullness in MSS segments */
+	int blimit;			/**< limit in bytes, 0 if there is none */
+	int blimit_max;		/**< largest dynamic limit, 0 if the limit is static */
+	int overlimit;		/**< bytes refused by the limit since the last tick */
+	int slack;			/**< lowest fullness in bytes since slack_start */
+	struct timeval slack_start;	/**< start of the slack measure */
+	bufshare_t *share;	/**< shared buffer the queue takes from, NULL if none */
+	const droppolicy_t *policy;	/**< drop policy */
+	void (*release)(void *);	/**< frees the queued packets the policy drops */
+	unsigned int seed;	/**< state of the random drops */
+	unsigned long drops[DROP_REASONS];	/**< dropped packets by reason */
+	struct pktqueue *prio;	/**< priority band for control packets, NULL if none */
+	int prio_cap;		/**< bytes the priority band holds and sends in a row while the queue waits */
+	int prio_run;		/**< bytes the priority band sent in a row while the queue waited */
+	const aqm_t *aqm;	/**< AQM, NULL if none */
+	char *aqm_params;	/**< parameters of the AQM, NULL for its defaults */
+	int aqm_mark;		/**< the AQM signals congestion instead of dropping */
+	unsigned long signals;	/**< congestion signals since the last queue_signal */
+	codel_t codel;		/**< CoDel state */
+	pie_t pie;			/**< PIE state */
+	red_t red;			/**< RED state */
+	fq_t *fq;			/**< FQ-CoDel state, NULL if the queue is a single FIFO */
+	struct trafclass *classes;	/**< traffic classes served by DRR, NULL if none */
+	int nclasses;		/**< number of classes, the default one last */
+	int cls_cur;		/**< class whose turn it is */
+	int drain;			/**< usecs a segment takes to depart, 0 if not known */
 } pktqueue_t;
 
+/**
+ * A traffic class of a pktqueue_t: its packets wait in a pktqueue_t of
+ * their own, with its own limits, drops and AQM, until the deficit round
+ * robin of the classes gives them their turn.
+ *
+ * @brief	Traffic class
+ */
+typedef struct trafclass {
+	classrule_t rule;				/**< packets it takes */
+	pktqueue_t q;					/**< its packets and counters */
+	int quantum;					/**< bytes it sends per round */
+	int deficit;					/**< bytes it can still send in this round */
+	unsigned long pkts;				/**< packets departed */
+	unsigned long bytes;			/**< bytes departed */
+} trafclass_t;
+
+/**
+ * Limits of a paced dequeue: packets depart while their departure time has
+ * come, each one moving the next departure by usecs per MSS segment, and
+ * while they fit in the byte budget, the first one always fitting. The
+ * limits are checked on the packet that actually departs, after the AQM
+ * and the schedulers of the queue have chosen it.
+ *
+ * @brief	Departure limits of dequeue_batch
+ */
+typedef struct {
+	struct timeval now;				/**< current time */
+	struct timeval depart;			/**< departure time of the next packet, updated */
+	long usecs;						/**< usecs a segment takes to depart */
+	int budget;						/**< most bytes to dequeue */
+	int overhead;					/**< bytes sent along with every packet */
+	int bytes;						/**< bytes dequeued, overhead included, updated */
+} pace_t;
+
+/**
+ * Single producer single consumer variant of pktqueue_t for two threads
+ * handing packets over without locks. Its size is a power of two and
+ * every slot is used: head and tail are free running positions masked
+ * into desc. Each side only writes its own cache line, publishing its
+ * position with release stores that the other side loads with acquire.
+ * The fullness counters are kept as totals in and out, one per side, so
+ * either thread can compute them; sfullness is sampled by the producer.
+ * A worker reading tun/tap from a second thread gets its packets through
+ * one and hands empty packets back through another (see rx_thread).
+ *
+ * @brief	packet_t lock-free SPSC ring
+ */
+typedef struct {
+	char Qname[10];				/**< name of the ring */
+	pktdesc_t *desc;			/**< descriptors of the slots */
+	uint32_t mask;				/**< size of the ring - 1 */
+
+	uint32_t tail __attribute__((aligned(RING_CACHELINE)));	/**< next position to enqueue (producer) */
+	uint32_t head_cache;		/**< head last seen by the producer */
+	unsigned long bytes_in;		/**< bytes enqueued */
+	unsigned long segs_in;		/**< MSS segments enqueued */
+	float sfullness;			/**< smooth fullness of segments (producer) */
+	float weight;				/**< weight of the current fullness in sfullness */
+
+	uint32_t head __attribute__((aligned(RING_CACHELINE)));	/**< next position to dequeue (consumer) */
+	uint32_t tail_cache;		/**< tail last seen by the consumer */
+	unsigned long bytes_out;	/**< bytes dequeued */
+	unsigned long segs_out;		/**< MSS segments dequeued */
+} pktring_t;
+
+/**
+ * Fixed set of packets of the same allocation size, allocated at once and
+ * taken and given back in O(1) from a stack of free packets. When the pool
+ * is exhausted pool_get returns the drop packet: input read into it is
+ * discarded, so the memory used never grows past the pool. The arena is
+ * mapped in hugepages if asked to, faulted in and locked at startup, so the
+ * data path takes neither page faults nor many TLB misses.
+ *
+ * @brief	packet_t pool
+ */
+typedef struct {
+	char name[10];				/**< name of the pool */
+	uint8_t *area;				/**< memory of the packets */
+	size_t arealen;				/**< length of the arena mapping */
+	int pages;					/**< pages backing the arena (POOL_PAGES_*) */
+	size_t pktsize;				/**< allocation size of a packet */
+	int capacity;				/**< number of packets */
+	packet_t **free;			/**< stack of free packets */
+	int nfree;					/**< number of free packets */
+	int highwater;				/**< most packets ever in use */
+	unsigned long exhausted;	/**< pool_get calls finding no free packet */
+	packet_t *drop;				/**< packet returned when exhausted */
+} pktpool_t;
+
 int isempty(pktqueue_t *p);
 void queue_init(pktqueue_t *p, int queuesize, char *Qname);
+const droppolicy_t *drop_policy(char *name);
+void queue_policy(pktqueue_t *p, const droppolicy_t *policy, void (*release)(void *));
+void queue_limit(pktqueue_t *p, int bytes, int dynamic);
+void queue_prio(pktqueue_t *p, int cap);
+const aqm_t *aqm_find(char *name);
+void queue_aqm(pktqueue_t *p, const aqm_t *aqm, char *params, int mark);
+int queue_signal(pktqueue_t *p);
+int class_parse(classrule_t *r, char *spec);
+void queue_classes(pktqueue_t *p, classrule_t *rules, int n);
+void print_classes(pktqueue_t *p);
+void queue_drain(pktqueue_t *p, int usecs);
+void queue_tick(pktqueue_t *p);
+void share_init(bufshare_t *b, long size, float alpha);
+void queue_share(pktqueue_t *p, bufshare_t *b);
+int queue_threshold(pktqueue_t *p);
+int queue_slots(pktqueue_t *p);
 int enqueue_packet(pktqueue_t *p, packet_t *pkt);
+int enqueue_batch(pktqueue_t *p, packet_t **pkts, int n);
+int dequeue_batch(pktqueue_t *p, packet_t **pkts, int n, pace_t *pace);
 packet_t *read_packet(pktqueue_t *p);
+pktdesc_t *read_desc(pktqueue_t *p, int i);
 packet_t * dequeue_packet(pktqueue_t *p);
 static inline float ewma(float, float, int);
+void pool_init(pktpool_t *p, int capacity, size_t pktsize, char *name, int pages);
+packet_t *pool_get(pktpool_t *p);
+void pool_put(pktpool_t *p, packet_t *pkt);
+void print_pool(pktpool_t *p);
+void pools_init(pktpool_t *pools, int capacity, int large, char *name, int pages);
+int pool_owns(pktpool_t *p, packet_t *pkt);
+packet_t *pool_get_fit(pktpool_t *pools, int len);
+packet_t *pool_fit(pktpool_t *pools, packet_t *pkt, int hdrlen);
+void pool_release(pktpool_t *pools, packet_t *pkt);
+
+/** drop packet of a set of size classed pools, the only one they hand out */
+#define POOL_DROP(pools) ((pools)[PKT_CLASSES - 1].drop)
+void ring_init(pktring_t *r, int ringsize, char *Qname);
+int ring_enqueue(pktring_t *r, packet_t *pkt);
+packet_t *ring_peek(pktring_t *r);
+packet_t *ring_dequeue(pktring_t *r);
+int ring_fullness(pktring_t *r);
+int ring_bfullness(pktring_t *r);
+int ring_segfullness(pktring_t *r);
+void print_ring(pktring_t *r, char ev);
@@ -0,0 +1,121 @@
+/**
+ * @file	rxring.c
+ * @authors	simpletun contributors
+ * @date	October 2026
+ * @license GNU GPL	v3
+ * @brief	Ring buffer to reassemble the frames received from the socket
+ *
+ * The socket carries [length][packet] frames. Every read pulls as many bytes
+ * as the socket has (without blocking) into the ring, then the complete
+ * frames are sliced out and a partial one waits there for the rest.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h> /* exit() */
+#include <arpa/inet.h> /* ntohs() */
+
+#include "rxring.h"
+
+#undef min
+#define min(x,y) ((x) < (y) ? (x) : (y))
+
+/**
+ * Initializes a rxring_t
+ *
+ * @brief	Initializes a rxring_t
+ * @param	r Ring to initialize
+ * @param	size Size of the ring, a power of 2
+ *
+ */
+void rxring_init(rxring_t *r, unsigned size) {
+	r->buf = malloc(size);
+	if (r->buf == NULL) {
+		perror("Allocating receive ring");
+		exit(1);
+	}
+	r->size = size;
+	r->head = r->tail = 0;
+}
+
+/**
+ * Reads from the socket every byte available that fits in the ring with a
+ * single non-blocking call
+ *
+ * @brief	Fills the ring from the socket
+ * @param	r Ring
+ * @param	fd Socket file descriptor
+ * @return	Number of read bytes, 0 if the peer closed the connection, -1 if
+ *			there was nothing to read or the ring is full
+ *
+ */
+int rxring_fill(rxring_t *r, int fd) {
+	struct iovec iov[2];
+	struct msghdr msg;
+	unsigned pos = r->tail & (r->size - 1);
+	unsigned room = r->size - (r->tail - r->head);
+	int n;
+
+	if (room == 0) return -1;
+	iov[0].iov_base = r->buf + pos;
+	iov[0].iov_len = min(room, r->size - pos);
+	iov[1].iov_base = r->buf;
+	iov[1].iov_len = room - iov[0].iov_len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iov[1].iov_len ? 2 : 1;
+	if ((n = recvmsg(fd, &msg, MSG_DONTWAIT)) < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return -1;
+		perror("Reading data");
+		exit(1);
+	}
+	r->tail += n;
+	return n;
+}
+
+/**
+ * Checks if the ring starts with a complete frame: the 16 bit length in
+ * network order, extra bytes of header and the packet of that length
+ *
+ * @brief	Checks for a complete frame
+ * @param	r Ring
+ * @param	extra Bytes between the length and the packet
+ * @return	Bytes of the frame after the length (extra + packet), -1 if the
+ *			frame is not complete yet
+ *
+ */
+int rxring_frame(rxring_t *r, int extra) {
+	uint16_t plength;
+	unsigned mask = r->size - 1;
+
+	if (r->tail - r->head < sizeof(plength)) return -1;
+	((char *)&plength)[0] = r->buf[r->head & mask];
+	((char *)&plength)[1] = r->buf[(r->head + 1) & mask];
+	if (r->tail - r->head < sizeof(plength) + extra + ntohs(plength)) return -1;
+	return extra + ntohs(plength);
+}
+
+/**
+ * Copies n bytes from the front of the ring and consumes them
+ *
+ * @brief	Reads from the ring
+ * @param	r Ring
+ * @param	buf Buffer to copy to
+ * @param	n Number of bytes, there must be at least n in the ring
+ *
+ */
+void rxring_read(rxring_t *r, char *buf, int n) {
+	unsigned pos = r->head & (r->size - 1);
+	unsigned len = min((unsigned)n, r->size - pos);
+
+	memcpy(buf, r->buf + pos, len);
+	memcpy(buf + len, r->buf, n - len);
+	r->head += n;
+}
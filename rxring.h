@@ -0,0 +1,29 @@
+/**
+ * @file	rxring.h
+ * @authors	simpletun contributors
+ * @date	October 2026
+ * @license GNU GPL	v3
+ * @brief	Ring buffer to reassemble the frames received from the socket
+ *
+ */
+#include <stdint.h>
+
+#define RXRING_SIZE	262144	/**< size of the ring (power of 2, >= 2 frames of 64 KB) */
+
+/**
+ * Bytes of the socket stream received and not consumed yet. head and tail
+ * run freely, the position in buf is taken modulo size.
+ *
+ * @brief	Socket stream ring buffer
+ */
+typedef struct {
+	char *buf;			/**< ring memory */
+	unsigned size;		/**< size of the ring */
+	unsigned head;		/**< first byte not consumed */
+	unsigned tail;		/**< first free byte */
+} rxring_t;
+
+void rxring_init(rxring_t *r, unsigned size);
+int rxring_fill(rxring_t *r, int fd);
+int rxring_frame(rxring_t *r, int extra);
+void rxring_read(rxring_t *r, char *buf, int n);
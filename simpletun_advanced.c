@@ -23,6 +23,7 @@
 
 
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,16 +33,28 @@
 #include <linux/if_tun.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <arpa/inet.h> 
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <time.h>
 #include <sys/time.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
 
 #include "queue.h"
 #include "process_pkt.h"
+#include "uring.h"
+#include "rxring.h"
+#include "zcopy.h"
+#include "wire.h"
+#include "xsk.h"
 
 
 
@@ -50,6 +63,15 @@
 #define CLIENT 0
 #define SERVER 1
 #define PORT 55555
+#define MAX_QUEUES 64
+/* a batched write to the socket gathers at most BATCH_MAX packets */
+#define BATCH_MAX 64
+/* packets of a queue without a byte limit */
+#define QUEUE_SLOTS 100
+/* default byte budget of a batched write to the socket */
+#define BATCH_BYTES 65536
+/* large packets a worker lends to its RX thread (-r), a power of two */
+#define RX_PACKETS 64
 
 /* some common lengths */
 #define IP_HDR_LEN 20
@@ -64,8 +86,66 @@
 #define FDTAP_OUT_OVERRUN	0x10
 #define FDSOCK_OUT_OVERRUN	0x20
 
+/* I/O engines */
+#define ENGINE_EPOLL		0
+#define ENGINE_URING		1
+
+/* Tunnel transports */
+#define TRANSPORT_TCP		0
+#define TRANSPORT_UDP		1
+#define TRANSPORT_WIRE		2	/* bump-in-the-wire between two interfaces */
+#define TRANSPORT_XDP		3	/* bump-in-the-wire through AF_XDP sockets */
+
 int debug;
 char *progname;
+int engine = ENGINE_EPOLL;
+/* size of the virtio-net header read and written with every packet, 0 without -g */
+int vnet_len = 0;
+/* size of the header read and written before packet data (virtio-net or ethernet) */
+int hdr_len = 0;
+/* byte budget of a batched write to the socket */
+int batch_bytes = BATCH_BYTES;
+int transport = TRANSPORT_TCP;
+/* frames of at least zc_threshold bytes are sent with MSG_ZEROCOPY, 0 disables it */
+int zc_threshold = 0;
+/* every worker reads tun/tap in an RX thread of its own */
+int rx_threads = 0;
+__thread uring_t uring;
+/* packet rings of the worker in wire mode (tap side, sock side) */
+__thread wire_t *wire;
+/* AF_XDP sockets of the worker in xdp mode (tap side, sock side) */
+__thread xsk_t *xsk;
+/* tunnel socket written without waiting for room (epoll engine), -1 if none */
+__thread int io_sockfd = -1;
+/* a write found the tunnel socket buffer full, cleared when it reports room */
+__thread int sock_blocked = 0;
+/* packets of the worker, a pool per size class */
+__thread pktpool_t pool[PKT_CLASSES];
+/* large packet the tun/tap device and the packet rings are read into */
+__thread packet_t *landing;
+/* packets of every pool of a worker, 0 sizes them from the queues */
+int pool_size = 0;
+/* pages backing the pool arenas */
+int pool_pages = POOL_PAGES_HUGETLB;
+/* byte limit of the queues, 0 limits them to QUEUE_SLOTS packets only */
+int queue_bytes = 0;
+/* the byte limit follows the drain of the queues (BQL) */
+int queue_bql = 0;
+/* buffer shared by the queues of every worker, bytes 0 if they have none */
+bufshare_t share;
+long share_bytes = 0;
+float share_alpha = 1;
+/* drop policies of the queues, tail drop by default */
+const droppolicy_t *tap_policy = NULL, *sock_policy = NULL;
+/* bytes of the priority band of the queues for control packets, 0 if none */
+int prio_bytes = 0;
+/* active queue management of the tun/tap and socket queues and their
+ * parameters, none if NULL */
+const aqm_t *aqm_type[2] = { NULL, NULL };
+char *aqm_params[2] = { NULL, NULL };
+/* traffic classes of the queues besides the default one, none if 0 */
+classrule_t classes[CLASS_MAX];
+int nclasses = 0;
 
 
 /**
@@ -98,19 +178,52 @@ int tun_alloc(char *dev, int flags) {
 		return err;
 	}
 
+	/* let the kernel hand us (and accept) TSO/GRO super-packets */
+	if ( (flags & IFF_VNET_HDR) &&
+		 (err = ioctl(fd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6)) < 0 ) {
+		perror("ioctl(TUNSETOFFLOAD)");
+		close(fd);
+		return err;
+	}
+
 	strcpy(dev, ifr.ifr_name);
 
 	return fd;
 }
 
 /**
- * Read routine that checks for errors and exits if an error is returned
+ * Reads the MTU of an interface
+ *
+ * @param[in]	dev name of the interface
+ * @return		MTU, -1 on error
+ *
+ */
+int if_mtu(char *dev) {
+	struct ifreq ifr;
+	int fd, err;
+
+	if ( (fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ) {
+		perror("socket()");
+		return fd;
+	}
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, dev, IFNAMSIZ - 1);
+	if ( (err = ioctl(fd, SIOCGIFMTU, (void *)&ifr)) < 0 )
+		perror("ioctl(SIOCGIFMTU)");
+	close(fd);
+	return err < 0 ? err : ifr.ifr_mtu;
+}
+
+/**
+ * Read routine that checks for errors and exits if an error is returned.
+ * With the io_uring engine it reads the data already received by the engine.
+ * In wire mode it takes the next frame captured in the receive ring of fd.
  *
  * @brief		Read n bytes from file descriptor
  * @param[in]	fd file descriptor to read from
  * @param[out]	buf buffer to save to
  * @param[in]	n number of bytes to read
- * @return		number of read bytes
+ * @return		number of read bytes, -1 if the wire ring is empty
  *
  */
 int cread(int fd, char *buf, int n)
@@ -118,6 +231,9 @@ int cread(int fd, char *buf, int n)
   
   int nread;
 
+  if (engine == ENGINE_URING) return uring_read(&uring, fd, buf, n);
+  if (transport == TRANSPORT_WIRE) return wire_read(&wire[fd != wire[0].fd], buf, n);
+
   if((nread=read(fd, buf, n))<0){
     perror("Reading data");
     exit(1);
@@ -126,7 +242,11 @@ int cread(int fd, char *buf, int n)
 }
 
 /**
- * Write routine that checks for errors and exits if an error is returned
+ * Write routine that checks for errors and exits if an error is returned.
+ * With the io_uring engine the write is queued and submitted by the next
+ * io_timeout call. In wire and xdp mode the frame is queued in the transmit
+ * ring of fd and sent by the next io_timeout call, a frame too long is
+ * dropped.
  *
  * @brief		Write n bytes from file descriptor
  * @param[in]	fd file descriptor to write to
@@ -139,6 +259,15 @@ int cwrite(int fd, char *buf, int n)
 {
 	int nwrite;
 
+	if (engine == ENGINE_URING) return uring_write(&uring, fd, buf, n);
+	// frames the transmit ring cannot take are counted there
+	if (transport == TRANSPORT_WIRE) return wire_write(&wire[fd != wire[0].fd], buf, n);
+	if (transport == TRANSPORT_XDP) {
+		if ((nwrite = xsk_write(&xsk[fd != xsk[0].fd], buf, n)) < 0)
+			perror("Writing frame");
+		return nwrite;
+	}
+
 	if((nwrite=write(fd, buf, n))<0){
 		perror("Writing data");
 		exit(1);
@@ -147,6 +276,108 @@ int cwrite(int fd, char *buf, int n)
 }
 
 
+/**
+ * Gathering write routine that checks for errors and exits if an error is
+ * returned. With the io_uring engine the data is copied to as few writes as
+ * possible, which are queued and submitted by the next io_timeout call.
+ * The tunnel socket is first written without waiting for room: if its
+ * buffer is full sock_blocked is set, and the rest of the data is written
+ * waiting for room, as a frame cannot be cut from the stream. The buffers
+ * may be modified.
+ *
+ * @brief		Write several buffers to a file descriptor
+ * @param[in]	fd file descriptor to write to
+ * @param[in]	iov buffers to write from
+ * @param[in]	iovcnt number of buffers
+ * @return		number of written bytes
+ * 
+ */
+int cwritev(int fd, struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg;
+	int n, flags, nwrite = 0;
+
+	if (engine == ENGINE_URING) return uring_writev(&uring, fd, iov, iovcnt);
+
+	if (fd != io_sockfd) {
+		if((nwrite=writev(fd, iov, iovcnt))<0){
+			perror("Writing data");
+			exit(1);
+		}
+		return nwrite;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	flags = MSG_DONTWAIT;
+	while (msg.msg_iovlen > 0) {
+		if ((n = sendmsg(fd, &msg, flags)) < 0) {
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN) {
+				perror("Writing data");
+				exit(1);
+			}
+			n = 0;
+		}
+		nwrite += n;
+		// skip the data sent
+		for (; msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len; msg.msg_iov++, msg.msg_iovlen--)
+			n -= msg.msg_iov->iov_len;
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+			msg.msg_iov->iov_len -= n;
+			sock_blocked = 1;
+			flags = 0;
+		}
+	}
+	return nwrite;
+}
+
+/**
+ * Sends every buffer as a datagram with as few sendmmsg calls as possible,
+ * exits if an error is returned. Datagrams refused by the peer (not
+ * listening yet) are lost. The socket is first written without waiting for
+ * room, if its buffer is full sock_blocked is set and the rest of the
+ * datagrams wait for room.
+ *
+ * @brief		Send several datagrams
+ * @param[in]	fd connected datagram socket
+ * @param[in]	iov one buffer per datagram
+ * @param[in]	n number of datagrams (at most BATCH_MAX)
+ * @return		number of sent bytes
+ *
+ */
+int csendmmsg(int fd, struct iovec *iov, int n)
+{
+	struct mmsghdr msgs[BATCH_MAX];
+	int i, sent, flags, nwrite = 0;
+
+	memset(msgs, 0, n*sizeof(struct mmsghdr));
+	for (i = 0; i < n; i++) {
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	flags = fd == io_sockfd ? MSG_DONTWAIT : 0;
+	for (i = 0; i < n; i += sent) {
+		if ((sent = sendmmsg(fd, msgs + i, n - i, flags)) < 0) {
+			if (errno == ECONNREFUSED) return nwrite;
+			if (errno == EAGAIN) {
+				sock_blocked = 1;
+				flags = 0;
+				sent = 0;
+				continue;
+			}
+			perror("Writing data");
+			exit(1);
+		}
+	}
+	for (i = 0; i < n; i++)
+		nwrite += msgs[i].msg_len;
+	return nwrite;
+}
+
+
 /**
  * Ensures we read exactly n bytes, and puts those into "buf"
  * (unless EOF, of course)
@@ -205,10 +436,6 @@ void my_err(char *msg, ...) {
 
 
 /**
- * @var timeout
- * Wall time to next output event (tap or sock writing)
- * Used in select function.
- * 
  * @var  qtap_next_pkt_out
  * Wall time to the next output event to dequeue a packet
  * from Qtap queue. This dequeued packet has to be send through 
@@ -221,11 +448,42 @@ void my_err(char *msg, ...) {
  * the tap device.	If qsock_next_pkt_out.tv_sec = -1 then there is
  * not scheduled time loaded (Empty queue => no waiting packet to send)
  *
+ * Every worker thread has its own copy of the scheduling state.
+ *
  */
  
-struct timeval timeout;
-struct timeval qtap_next_pkt_out;
-struct timeval qsock_next_pkt_out;
+__thread struct timeval qtap_next_pkt_out;
+__thread struct timeval qsock_next_pkt_out;
+
+/**
+ * @var qtap_due
+ * Wall time the last FDSOCK_OUT_OK event returned by io_timeout was
+ * scheduled at. Packets of Qtap depart T microseconds per segment after it.
+ */
+__thread struct timeval qtap_due;
+
+/**
+ * Worker owning one tun/tap queue, its tunnel connection and its
+ * Qtap/Qsock pair
+ *
+ * @brief	Worker thread data
+ */
+typedef struct {
+	int index;			/**< worker and tun/tap queue number */
+	int cpu;			/**< core the worker is pinned to, -1 if not pinned */
+	int tap_fd;			/**< tun/tap queue file descriptor */
+	int net_fd;			/**< tunnel connection file descriptor */
+	wire_t wire[2];		/**< packet rings in wire mode (tap_fd, net_fd) */
+	xsk_umem_t umem;	/**< UMEM of the AF_XDP sockets in xdp mode */
+	xsk_t xsk[2];		/**< AF_XDP sockets in xdp mode (tap_fd, net_fd) */
+	pthread_t thread;	/**< worker thread */
+	pktring_t handoff;	/**< packets read by the RX thread (-r) */
+	pktring_t fill;		/**< empty large packets lent to the RX thread */
+	int lent;			/**< packets in handoff and fill, counted by the worker */
+	int rx_efd;			/**< eventfd the RX thread wakes the worker with */
+	unsigned long rxdrops;	/**< packets the RX thread read with none lent */
+	pthread_t rx;		/**< RX thread */
+} worker_t;
 
 /**
  * @var static long int T 
@@ -234,6 +492,212 @@ struct timeval qsock_next_pkt_out;
  */
 static long int T = 50000;
 
+/**
+ * @var epfd
+ * epoll instance watching tap and sock for input, the room of the tunnel
+ * socket after a write found it full, and the timer
+ *
+ * @var tfd
+ * timerfd loaded with the earliest output time, used only by kernels
+ * without epoll_pwait2
+ *
+ * @var armed
+ * Time currently loaded in tfd (tv_sec = -1 if disarmed)
+ *
+ * @var no_pwait2
+ * epoll_pwait2 is not available, the output times are waited with tfd
+ */
+static __thread int epfd, tfd, no_pwait2;
+static __thread struct timeval armed;
+
+/**
+ * Adds a filedes to an epoll instance, using the io_timeout event bit as
+ * the epoll user data
+ *
+ * @param[in]	ep epoll instance
+ * @param[in]	fd file descriptor to watch
+ * @param[in]	events epoll events to watch
+ * @param[in]	bit FDTAP_* / FDSOCK_* value returned when the event occurs
+ *
+ */
+static void io_watch(int ep, int fd, uint32_t events, int bit)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.u32 = bit;
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		perror("epoll_ctl()");
+		exit(1);
+	}
+}
+
+/**
+ * Sets up the epoll instance and the timer used by io_timeout.
+ * Must be called once before the first io_timeout call.
+ * With an RX thread (-r) tap input is its eventfd, watched edge triggered as
+ * it is never read.
+ *
+ * The tap device never blocks a write, and neither do the packet rings of
+ * the wire and xdp modes. The tunnel socket is written without waiting for
+ * room (cwritev, csendmmsg), a second filedes of it reports edge triggered
+ * when its buffer has room again after a write found it full.
+ *
+ * @param[in]	fdtap tap file descriptor, or eventfd of the RX thread
+ * @param[in]	fdsock socket file descriptor
+ *
+ */
+void io_init(int fdtap, int fdsock)
+{
+	int fd;
+
+	if ((epfd = epoll_create1(0)) < 0) {
+		perror("epoll_create1()");
+		exit(1);
+	}
+	if ((tfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK)) < 0) {
+		perror("timerfd_create()");
+		exit(1);
+	}
+
+	io_watch(epfd, fdtap, rx_threads ? EPOLLIN | EPOLLET : EPOLLIN, FDTAP_IN_RDY);
+	io_watch(epfd, fdsock, EPOLLIN, FDSOCK_IN_RDY);
+	io_watch(epfd, tfd, EPOLLIN | EPOLLET, 0);
+	if (transport < TRANSPORT_WIRE) {
+		if ((fd = dup(fdsock)) < 0) {
+			perror("dup()");
+			exit(1);
+		}
+		io_watch(epfd, fd, EPOLLOUT | EPOLLET, FDSOCK_OUT_OK);
+		io_sockfd = fdsock;
+	}
+
+	armed.tv_sec = -1;
+}
+
+/**
+ * Loads the earliest output time in the timer. Nothing is done if the timer
+ * already holds it.
+ *
+ * @param[in]	next earliest output time, NULL disarms the timer
+ *
+ */
+static void io_arm(struct timeval *next)
+{
+	struct itimerspec its;
+
+	if (next == NULL ? armed.tv_sec == -1 :
+		next->tv_sec == armed.tv_sec && next->tv_usec == armed.tv_usec)
+		return;
+
+	memset(&its, 0, sizeof(its));
+	if (next != NULL) {
+		its.it_value.tv_sec = next->tv_sec;
+		its.it_value.tv_nsec = next->tv_usec*1000;
+	}
+	if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		perror("timerfd_settime()");
+		exit(1);
+	}
+	if (next == NULL) armed.tv_sec = -1;
+	else armed = *next;
+}
+
+/**
+ * Waits for epoll events until a wall time. The timeout of epoll_pwait2 is
+ * used, or the timer on kernels without it.
+ *
+ * @param[out]	events events reported
+ * @param[in]	maxevents size of events
+ * @param[in]	until wall time to wait until, NULL waits for events only
+ * @return		number of events, -1 on error
+ *
+ */
+static int io_wait(struct epoll_event *events, int maxevents, struct timeval *until)
+{
+	struct timeval now;
+	struct timespec ts;
+	int n;
+
+	if (!no_pwait2) {
+		if (until != NULL) {
+			gettimeofday(&now, NULL);
+			ts.tv_sec = 0;
+			ts.tv_nsec = 0;
+			if (timercmp(&now, until, <)) {
+				timersub(until, &now, &now);
+				ts.tv_sec = now.tv_sec;
+				ts.tv_nsec = now.tv_usec*1000;
+			}
+		}
+		n = epoll_pwait2(epfd, events, maxevents, until ? &ts : NULL, NULL);
+		if (n >= 0 || errno != ENOSYS) return n;
+		no_pwait2 = 1;
+	}
+	io_arm(until);
+	return epoll_wait(epfd, events, maxevents, -1);
+}
+
+/**
+ * Schedules the next output event of a queue T microseconds from now
+ *
+ * @param[out]	next scheduled output time
+ * @param[in]	now current time
+ *
+ */
+static void io_schedule(struct timeval *next, struct timeval *now)
+{
+	next->tv_sec = now->tv_sec + (now->tv_usec + T)/1000000;
+	next->tv_usec = (now->tv_usec + T)%1000000;
+}
+
+/**
+ * Moves a wall time usec microseconds forward
+ *
+ * @param[in,out]	tv wall time
+ * @param[in]		usec microseconds
+ *
+ */
+static void io_delay(struct timeval *tv, long int usec)
+{
+	tv->tv_usec += usec;
+	tv->tv_sec += tv->tv_usec/1000000;
+	tv->tv_usec %= 1000000;
+}
+
+/**
+ * Delays the next output event of a queue by T microseconds per extra segment
+ * of the GSO super-packet just sent, so the packet rate is kept in segments
+ *
+ * @param[in,out]	next scheduled output time
+ * @param[in]		segs segments of the packet just sent
+ *
+ */
+static void io_pace(struct timeval *next, int segs)
+{
+	if (next->tv_sec == -1 || segs <= 1) return;
+	io_delay(next, (segs - 1)*T);
+}
+
+/**
+ * Returns the earliest scheduled output event. Qtap output is not waited
+ * for while the tunnel socket has no room.
+ *
+ * @return		qtap_next_pkt_out or qsock_next_pkt_out, NULL if none is scheduled
+ *
+ */
+static struct timeval *io_next_out(void)
+{
+	int qtap = qtap_next_pkt_out.tv_sec != -1 && !sock_blocked;
+
+	if (!qtap && qsock_next_pkt_out.tv_sec == -1) return NULL;
+	if (!qtap) return &qsock_next_pkt_out;
+	if (qsock_next_pkt_out.tv_sec == -1) return &qtap_next_pkt_out;
+	return timercmp(&qtap_next_pkt_out, &qsock_next_pkt_out, <) ?
+		&qtap_next_pkt_out : &qsock_next_pkt_out;
+}
+
 /**
  * 
  * @brief This function schedules filedes output events
@@ -246,6 +710,15 @@ static long int T = 50000;
  * when a packet has to be send in order to cope with the selected packet 
  * rate (T variable).
  * 
+ * Every event is waited with a single epoll_pwait2: tap and sock input, and
+ * the room of the tunnel socket after a write found it full. The earliest
+ * output time is its timeout, so an output event costs no syscall besides
+ * the wait and the write. Kernels without epoll_pwait2 load the earliest
+ * output time in a timerfd, only when it changes.
+ * Input and output events reported together are returned together.
+ * With the io_uring engine (-e uring) the wait is done by io_uring_enter,
+ * which also submits the queued writes.
+ * 
  * Return value is an ORed value which signa ls which operation(s) has
  * to be performed:
  * 		- (ret_val & FDTAP_IN_RDY) != 0. A packet is waiting to be read on 
@@ -278,40 +751,15 @@ static long int T = 50000;
  *         
  */
 
-int io_timeout (int fdtap, int fdsock) {
-	fd_set readfds, writefds;
-
-	/**
-	 * @var remain_usec1 
-	 * Remaining microseconds from now to the Qtap output event,
-	 * just when a packet has to be dequeue from Qtap
-	 * 
-	 */
-	long int remain_usec_1;
-	/**
-	 * @var remain_usec2 
-	 * Remaining microseconds from now to the Qsock output event,
-	 * just when a packet has to be dequeue from Qsock
-	 * 
-	 */
-	long int remain_usec_2;
-
-	struct timeval start_tv, stop_tv;
-	int srv, nfds, which, return_value, use_null_timeout;
+int io_timeout (void) {
+	struct epoll_event events[4];
+	struct timeval now;
+	int n, i, due, writable, return_value;
 	
 	do_debug("IO_TIMEOUT\n");
-	gettimeofday(&start_tv,NULL);
 	return_value = 0;
-
-	/* Initialize the timeout data structure. */
-	remain_usec_1 = (qtap_next_pkt_out.tv_sec - start_tv.tv_sec)*1000000 +
-		(qtap_next_pkt_out.tv_usec - start_tv.tv_usec);
-	remain_usec_2 = (qsock_next_pkt_out.tv_sec - start_tv.tv_sec)*1000000 +
-		(qsock_next_pkt_out.tv_usec - start_tv.tv_usec);
-
-
-    do_debug("qtap_next_pkt_out=%ld  qsock_next_pkt_out=%ld\n",
-		qtap_next_pkt_out.tv_sec, qsock_next_pkt_out.tv_sec);
+	due = 0;
+	writable = 0;
 
     do_debug("Schedule time for Qtap: %ld.%.6ld\n",
 		qtap_next_pkt_out.tv_sec, qtap_next_pkt_out.tv_usec);
@@ -319,104 +767,73 @@ int io_timeout (int fdtap, int fdsock) {
     do_debug("Schedule time for Qsock: %ld.%.6ld\n",
 		qsock_next_pkt_out.tv_sec, qsock_next_pkt_out.tv_usec);
 
-    do_debug("Now is: %ld.%.6ld\n", start_tv.tv_sec, start_tv.tv_usec);
-	do_debug("remain_usec_1 is: %ld\n", remain_usec_1);
-	do_debug("remain_usec_2 is: %ld\n", remain_usec_2);
-
-	if (remain_usec_1 < 0) remain_usec_1 = 0;
-	if (remain_usec_2 < 0) remain_usec_2 = 0;
-
-	//Nor a qtap packet nor a qsock packet has been scheduled for output
-	if (qtap_next_pkt_out.tv_sec == -1 && qsock_next_pkt_out.tv_sec == -1) {
-		// There is no packet to be send, disable timout and wait only for input event
-		use_null_timeout = 1;
+	if (transport == TRANSPORT_WIRE) {
+		// Send the frames queued in the transmit rings since the last call
+		wire_flush(&wire[0]);
+		wire_flush(&wire[1]);
 	}
-
-	//None qtap packet has been scheduled for output but yes for qsock
-	if (qtap_next_pkt_out.tv_sec == -1 && qsock_next_pkt_out.tv_sec >= 0) {
-		use_null_timeout = 0;
-		timeout.tv_sec = 0;
-		timeout.tv_usec = remain_usec_2;	
-		which = 2;
+	if (transport == TRANSPORT_XDP) {
+		// Kick the transmit rings and give the fill rings the free frames
+		xsk_flush(&xsk[0]);
+		xsk_flush(&xsk[1]);
 	}
-
-	//None qsock packet has been scheduled for output but yes for qtap
-	if (qsock_next_pkt_out.tv_sec == -1 && qtap_next_pkt_out.tv_sec >= 0) {
-		use_null_timeout = 0;
-		timeout.tv_sec = 0;
-		timeout.tv_usec = remain_usec_1;	
-		which = 1;
+	if (engine == ENGINE_URING) {
+		// Submit the queued writes and wait for input data until the
+		// earliest scheduled output time. An output filedes can be written
+		// when it has no write in flight.
+		n = uring_wait(&uring, io_next_out());
+		if (n & URING_TAP_IN) return_value = return_value | FDTAP_IN_RDY;
+		if (n & URING_SOCK_IN) return_value = return_value | FDSOCK_IN_RDY;
+		if (n & URING_TAP_IDLE) writable = writable | FDTAP_OUT_OK;
+		if (n & URING_SOCK_IDLE) writable = writable | FDSOCK_OUT_OK;
+	} else {
+		// Wait for an input event (tap or sock receives a packet) or the
+		// earliest output event. If no packet is scheduled we wait only for
+		// input events
+		n = io_wait(events, 4, io_next_out());
+		if (n < 0) {
+			if (errno == EINTR) return 0;
+			perror("epoll_wait()");
+			exit(1);
+		}
+		for (i = 0; i < n; i++) {
+			if (events[i].data.u32 == FDSOCK_OUT_OK)
+				sock_blocked = 0;
+			else
+				return_value = return_value | events[i].data.u32;
+		}
+		// tap never blocks a write, sock only when a write found it full
+		writable = FDTAP_OUT_OK | (sock_blocked ? 0 : FDSOCK_OUT_OK);
 	}
-
-	if (qtap_next_pkt_out.tv_sec >= 0 && qsock_next_pkt_out.tv_sec >= 0) {
-		use_null_timeout = 0;
-		// Select minimum waiting time to schedule the next output event
-    	if (remain_usec_1 < remain_usec_2) {
-			timeout.tv_sec = 0;
-			timeout.tv_usec = remain_usec_1;
-			which = 1;		
-		} else {
-			timeout.tv_sec = 0;
-			timeout.tv_usec = remain_usec_2;	
-			which = 2;
-		}
-	}	
-
-    do_debug("Remaining timeout: %ld\n", timeout.tv_sec*1000000 + timeout.tv_usec);
-	// We are going to wait for an input event (tap or sock receives a packet)
-	FD_ZERO (&readfds);
-	FD_SET (fdtap, &readfds);
-    FD_SET (fdsock, &readfds);
-  	nfds = max(fdtap, fdsock);
-	if (use_null_timeout) 
-		// There are no packet in queues to be send. Wait for an input event forever
-		srv = select (nfds + 1, &readfds, NULL, NULL, NULL);
-	else
-		// There is a packet scheduled to be send in timeout. Until timeout is reached
-		// wait for an input packet 
-  		srv = select (nfds + 1, &readfds, NULL, NULL, &timeout);
-	if (FD_ISSET(fdtap, &readfds)) {
+	gettimeofday(&now,NULL);
+	if (qtap_next_pkt_out.tv_sec != -1 && !timercmp(&now, &qtap_next_pkt_out, <))
+		due = due | FDSOCK_OUT_OK;
+	if (qsock_next_pkt_out.tv_sec != -1 && !timercmp(&now, &qsock_next_pkt_out, <))
+		due = due | FDTAP_OUT_OK;
+	if (return_value & FDTAP_IN_RDY) {
     	// A Packet has arrived from tap.
 		// Check if there is already a packet scheduled to be sent, if not, schedule this one
 		// Note that the first packet is scheduled to be sent BEFORE it is enqueued. 
 		if (qtap_next_pkt_out.tv_sec == -1) {
-			gettimeofday(&start_tv,NULL);
-			qtap_next_pkt_out.tv_sec = start_tv.tv_sec;
-			qtap_next_pkt_out.tv_usec = start_tv.tv_usec + T;
+			io_schedule(&qtap_next_pkt_out, &now);
 		}
-		return_value = return_value | FDTAP_IN_RDY;
 	}
-	if (FD_ISSET(fdsock, &readfds)) {
+	if (return_value & FDSOCK_IN_RDY) {
     	// A packet has arrived from sock
 		// Check if there is a packet scheduled to send, if not, schedule this one
 		if (qsock_next_pkt_out.tv_sec == -1) {
-			gettimeofday(&start_tv,NULL);
-			qsock_next_pkt_out.tv_sec = start_tv.tv_sec;
-			qsock_next_pkt_out.tv_usec = start_tv.tv_usec + T;
+			io_schedule(&qsock_next_pkt_out, &now);
 		}
-		return_value = return_value | FDSOCK_IN_RDY;
 	}
-	// If srv is zero a timeout has occurred: A packet is ready to be send
-    if (srv == 0) {
+	if (due) {
 		// Now, we must output a packet
-    	// First, check if write operation is not blocked on sock and tap filedes
-		// To do this use select with timeout=0.
-		FD_ZERO (&writefds);
-		FD_SET (fdtap, &writefds);
-    	FD_SET (fdsock, &writefds);
-  		nfds = max(fdtap, fdsock);
-		timeout.tv_sec = 0;
-		timeout.tv_usec = 0;
-  		srv = select (nfds + 1, NULL, &writefds, NULL, &timeout);
-		// We use "which" variable to select the right filedes where we have to send. 
-		if (which == 1) {      	
-			if (FD_ISSET(fdsock, &writefds)) {
+		if (due & FDSOCK_OUT_OK) {
+			if (writable & FDSOCK_OUT_OK) {
 				// sock is ready to be written
                 // Schedule next packet sending time in Qtap
-				gettimeofday(&start_tv,NULL);
-				qtap_next_pkt_out.tv_sec = start_tv.tv_sec;
-				qtap_next_pkt_out.tv_usec = start_tv.tv_usec + T;
-				do_debug("FDSOCK_OUT_OK in %d\n",start_tv.tv_sec*1000000 + start_tv.tv_usec );
+				qtap_due = qtap_next_pkt_out;
+				io_schedule(&qtap_next_pkt_out, &now);
+				do_debug("FDSOCK_OUT_OK in %ld\n", now.tv_sec*1000000 + now.tv_usec);
 				return_value = return_value | FDSOCK_OUT_OK;
 			} else {
 				// We have a problem: a packet has to be send through sock device
@@ -424,20 +841,17 @@ int io_timeout (int fdtap, int fdsock) {
 				return_value = return_value | FDSOCK_OUT_OVERRUN;				
 			}
 		}
-		if (which == 2) {      	
-			if (FD_ISSET(fdtap, &writefds)) {
+		if (due & FDTAP_OUT_OK) {
+			if (writable & FDTAP_OUT_OK) {
 				// Schedule next packet sending time
-				gettimeofday(&start_tv,NULL);
-				qsock_next_pkt_out.tv_sec = start_tv.tv_sec;
-				qsock_next_pkt_out.tv_usec = start_tv.tv_usec + T;
+				io_schedule(&qsock_next_pkt_out, &now);
 				return_value = return_value | FDTAP_OUT_OK;
-				do_debug("FDTAP_OUT_OK in %d\n",start_tv.tv_sec*1000000 + start_tv.tv_usec );
+				do_debug("FDTAP_OUT_OK in %ld\n", now.tv_sec*1000000 + now.tv_usec);
 			} else {
 				//A new packet has to be send through fdsock but write is blocked!!!
 				return_value = return_value | FDTAP_OUT_OVERRUN;				
 			}
 		}
-
 	}
 	return return_value;
 }
@@ -449,13 +863,33 @@ int io_timeout (int fdtap, int fdsock) {
 void usage(void)
 {
   fprintf(stderr, "Usage:\n");
-  fprintf(stderr, "%s -i <ifacename> [-s|-c <serverIP>] [-p <port>] [-u|-a] [-d]\n", progname);
+  fprintf(stderr, "%s -i <ifacename> [-s|-c <serverIP>] [-p <port>] [-u|-a] [-e <engine>] [-q <queues>] [-r] [-g] [-b <bytes>] [-t <transport>] [-z <bytes>] [-d]\n", progname);
+  fprintf(stderr, "%s -i <ifacename> -w|-x <ifacename> [-q <queues>] [-b <bytes>] [-d]\n", progname);
   fprintf(stderr, "%s -h\n", progname);
   fprintf(stderr, "\n");
   fprintf(stderr, "-i <ifacename>: Name of interface to use (mandatory)\n");
   fprintf(stderr, "-s|-c <serverIP>: run in server mode (-s), or specify server address (-c <serverIP>) (mandatory)\n");
   fprintf(stderr, "-p <port>: port to listen on (if run in server mode) or to connect to (in client mode), default 55555\n");
   fprintf(stderr, "-u|-a: use TUN (-u, default) or TAP (-a)\n");
+  fprintf(stderr, "-e <engine>: I/O engine, epoll (default) or uring\n");
+  fprintf(stderr, "-q <queues>: number of tun/tap queues, each one served by a worker pinned to a core, default 1\n");
+  fprintf(stderr, "-r: read tun/tap in a second thread per worker, which hands the packets over a lock-free ring (epoll engine, tcp or udp transport)\n");
+  fprintf(stderr, "-g: exchange GSO super-packets of up to 64 KB with the tun device (IFF_VNET_HDR), both ends must use it\n");
+  fprintf(stderr, "-t <transport>: tunnel over tcp (default) or udp, one packet per datagram\n");
+  fprintf(stderr, "-z <bytes>: send frames of at least <bytes> with MSG_ZEROCOPY (tcp transport, epoll engine), default off\n");
+  fprintf(stderr, "-w <ifacename>: bump-in-the-wire, bridge the -i interface and this one through TPACKET_V3 rings instead of a tun/tap device and a tunnel (offloads of the bridged links must be off)\n");
+  fprintf(stderr, "-x <ifacename>: bump-in-the-wire as -w through AF_XDP sockets (generic XDP), queued packets stay in the UMEM they were received in; -q must cover the queues of both interfaces\n");
+  fprintf(stderr, "-b <bytes>: byte budget of a batched write of due packets to the socket, default %d\n", BATCH_BYTES);
+  fprintf(stderr, "-l <bytes>: limit each queue to <bytes> besides %d packets, default no byte limit\n", QUEUE_SLOTS);
+  fprintf(stderr, "-L <bytes>: as -l with a limit following the drain of the queue (BQL), up to <bytes>\n");
+  fprintf(stderr, "-S <bytes>: queues of every worker share a buffer of <bytes>, each one taking packets while under alpha times the free buffer, default off\n");
+  fprintf(stderr, "-A <alpha>: alpha of the shared buffer thresholds, default 1\n");
+  fprintf(stderr, "-D <policy>[,<policy>]: drop policy of the queue from tun/tap and of the queue from the socket (the first one if not given), tail (default), head or random\n");
+  fprintf(stderr, "-k <bytes>: pure ACKs, SYNs and other control packets go ahead of the rest of each queue in a band of <bytes>, which sends no more than <bytes> in a row while the rest waits, default off\n");
+  fprintf(stderr, "-Q <aqm>[,<params>]: active queue management of the queues, codel[,<target>,<interval>] (usecs, default %d,%d), pie[,<target>,<tupdate>,<max_burst>] (usecs, default %d,%d,%d), red[,<min_th>,<max_th>,<weight>] (average segments, default %d,%d,%.2f) or fq_codel[,<target>,<interval>,<flows>,<quantum>] (flow queues served by DRR, each under CoDel, default %d,%d,%d,%d); a second -Q sets the queue from the socket apart, none for no AQM; on the queue from tun/tap it triggers the backward congestion control instead of dropping\n", CODEL_TARGET, CODEL_INTERVAL, PIE_TARGET, PIE_TUPDATE, PIE_MAXBURST, RED_MIN_TH, RED_MAX_TH, QUEUE_WEIGHT, CODEL_TARGET, CODEL_INTERVAL, FQ_FLOWS, FQ_QUANTUM);
+  fprintf(stderr, "-C <match>[,<weight>[,<quantum>]]: traffic class of the queues, dscp:<dscp>, proto:<tcp|udp|icmp|number> or port:<port>[-<port>] (source or destination), up to %d; the classes and a default one of weight 1 for the rest share the link by deficit round robin, sending <quantum> bytes per round (default <weight> times %d), each with the limits, policy, band and AQM of the queue\n", CLASS_MAX, CLASS_QUANTUM);
+  fprintf(stderr, "-P <packets>: packets preallocated by every worker, default enough for full queues\n");
+  fprintf(stderr, "-H <pages>: pages backing the preallocated packets, hugetlb (default, thp if no hugepage is reserved), thp or normal\n");
   fprintf(stderr, "-d: outputs debug information while running\n");
   fprintf(stderr, "-h: prints this help text\n");
   exit(1);
@@ -465,162 +899,364 @@ void usage(void)
 
 
 /**
- * The core of the program. Has the responsability of act accordingly to the
- * scheduler event and setting up the initial variables and structures
- * depending if it acts as a server or a client
+ * Releases a packet: in xdp mode a packet received in a UMEM frame gives
+ * the frame back, any other packet goes back to the pool of its size class
  *
- * @param	argc An integer argument count of the command line arguments
- * @param	argv An argument vector of the command line arguments
- * @return	0
+ * @param	packet packet to release
  */
-int main(int argc, char *argv[])
+void free_packet(void *packet)
 {
-	int tap_fd, option;
-	int flags = IFF_TUN;
-	char if_name[IFNAMSIZ] = "";
-	int header_len = IP_HDR_LEN;
-	int maxfd;
-	uint16_t nread, nwrite, plength;
-	char buffer[BUFSIZE];
-	struct sockaddr_in local, remote;
-	char remote_ip[16] = "";
-	unsigned short int port = PORT;
-	int sock_fd, net_fd, optval = 1;
-	socklen_t remotelen;
-	int cliserv = -1;    /* must be specified on cmd line */
-	unsigned long int tap2net = 0, net2tap = 0;
+	if (transport == TRANSPORT_XDP && xsk_owns(xsk[0].umem, packet))
+		xsk_put(xsk[0].umem, packet);
+	else
+		pool_release(pool, packet);
+}
 
- 	progname = argv[0];
-	
-  
-	/* Check command line options */
-	while((option = getopt(argc, argv, "i:sc:p:uahd")) > 0){
-		switch(option) {
-		case 'd':
-        	debug = 1;
-        	break;
-		case 'h':
-			usage();
-			break;
-		case 'i':
-			strncpy(if_name, optarg, IFNAMSIZ-1);
-			break;
-		case 's':
-			cliserv = SERVER;
-			break;
-		case 'c':
-			cliserv = CLIENT;
-			strncpy(remote_ip, optarg,15);
-			break;
-		case 'p':
-			port = atoi(optarg);
-			break;
-		case 'u':
-			flags = IFF_TUN;
-			break;
-		case 'a':
-			flags = IFF_TAP;
-			header_len = ETH_HDR_LEN;
-			break;
-		default:
-			my_err("Unknown option %c\n", option);
-			usage();
-		}
-	}
+/**
+ * Takes the next frame received by the AF_XDP socket of fd. The packet_t
+ * is laid over the headroom of its UMEM frame, so the frame is not copied:
+ * its ethernet header lands in hdr, right before data.
+ *
+ * @param	fd AF_XDP socket file descriptor
+ * @return	packet, NULL if no frame is waiting
+ */
+packet_t *xdp_read(int fd)
+{
+	packet_t *packet;
+	uint8_t *frame;
+	int len;
+
+	if ((frame = xsk_recv(&xsk[fd != xsk[0].fd], &len)) == NULL) return NULL;
+	packet = (packet_t *) (frame + hdr_len - offsetof(packet_t, data));
+	packet->length = len - hdr_len;
+	packet->segs = 1;
+	return packet;
+}
 
-	argv += optind;
-	argc -= optind;
+/**
+ * Reads a packet (and its virtio-net or ethernet header) from the tun/tap
+ * device, or a frame from a packet ring in wire mode, into the landing
+ * packet, a large one kept between reads, and moves it to the smallest
+ * size class it fits in.
+ *
+ * @param	fd tun/tap device or packet socket file descriptor
+ * @return	the packet, POOL_DROP(pool) if the pools are exhausted, NULL if
+ *			there is nothing to read
+ */
+packet_t *read_sized(int fd)
+{
+	packet_t *packet;
+	int nread;
+
+	if (landing == NULL || landing == POOL_DROP(pool)) landing = pool_get(&pool[PKT_CLASSES - 1]);
+	if ((nread = cread(fd, (char *)landing->data - hdr_len, PKT_LARGE + hdr_len)) < 0) return NULL;
+	landing->length = nread - hdr_len;
+	landing->segs = vnet_len ? getSegments(landing->data, PKT_VNET(landing)->gso_size) : 1;
+	packet = pool_fit(pool, landing, hdr_len);
+	if (packet == landing) landing = NULL;
+	return packet;
+}
 
-	if (argc > 0) {
-		my_err("Too many options!\n");
-		usage();
-	}
+/**
+ * Lends the RX thread of a worker empty large packets, up to RX_PACKETS
+ *
+ * @param	w worker
+ */
+void rx_lend(worker_t *w)
+{
+	packet_t *packet;
 
-	if (*if_name == '\0') {
-		my_err("Must specify interface name!\n");
-		usage();
-	} else if (cliserv < 0) {
-		my_err("Must specify client or server mode!\n");
-		usage();
-	} else if ((cliserv == CLIENT)&&(*remote_ip == '\0')) {
-		my_err("Must specify server address!\n");
-		usage();
+	for (; w->lent < RX_PACKETS; w->lent++) {
+		if ((packet = pool_get(&pool[PKT_CLASSES - 1])) == POOL_DROP(pool)) break;
+		ring_enqueue(&w->fill, packet);
 	}
+}
 
- 	/* initialize tun/tap interface */
-	if ( (tap_fd = tun_alloc(if_name, flags | IFF_NO_PI)) < 0 ) {
-		my_err("Error connecting to tun/tap interface %s!\n", if_name);
+/**
+ * Reads the tun/tap queue of a worker in a thread of its own (-r). Every
+ * packet is read into a large packet the worker lent in the fill ring and
+ * handed over in the handoff ring, without locks; the worker is woken
+ * through its eventfd when it may have found that ring empty. With no
+ * packet lent the packet read is dropped.
+ *
+ * @param	arg worker_t of the worker
+ * @return	NULL
+ */
+void *rx_thread(void *arg)
+{
+	worker_t *w = (worker_t *) arg;
+	packet_t *packet = NULL;
+	uint64_t one = 1;
+	char *spare;
+	int nread;
+
+	if ((spare = malloc(PKT_LARGE + hdr_len)) == NULL) {
+		perror("Allocating RX buffer");
 		exit(1);
 	}
-
-	do_debug("Successfully connected to interface %s\n", if_name);
-
-	if ( (sock_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-		perror("socket()");
-		exit(1);
+	while (1) {
+		if (packet == NULL && (packet = ring_dequeue(&w->fill)) == NULL) {
+			// the worker lags behind
+			cread(w->tap_fd, spare, PKT_LARGE + hdr_len);
+			w->rxdrops++;
+			do_debug("Worker %d: %lu packets dropped by its RX thread\n", w->index, w->rxdrops);
+			continue;
+		}
+		nread = cread(w->tap_fd, (char *)packet->data - hdr_len, PKT_LARGE + hdr_len);
+		packet->length = nread - hdr_len;
+		packet->segs = vnet_len ? getSegments(packet->data, PKT_VNET(packet)->gso_size) : 1;
+		// both rings hold every packet lent, the handoff ring has room
+		if (!ring_enqueue(&w->handoff, packet)) continue;
+		packet = NULL;
+		// the worker sleeps only after finding the ring empty past the
+		// same fence (read_handoff), so one of them sees the other
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (ring_fullness(&w->handoff) == 1 && write(w->rx_efd, &one, sizeof(one)) < 0) {
+			perror("Waking worker");
+			exit(1);
+		}
 	}
+	return NULL;
+}
 
+/**
+ * Takes the next packet the RX thread of a worker read from the tun/tap
+ * device, in the smallest size class it fits in. The large packet it was
+ * read into is lent again if the packet was copied.
+ *
+ * @param	w worker
+ * @return	the packet, POOL_DROP(pool) if the pools are exhausted, NULL if
+ *			the RX thread handed none over
+ */
+packet_t *read_handoff(worker_t *w)
+{
+	packet_t *packet, *large;
 
-	if(cliserv==CLIENT) {
-		/* Client, try to connect to server */
-
-		/* assign the destination address */
-		memset(&remote, 0, sizeof(remote));
-		remote.sin_family = AF_INET;
-		remote.sin_addr.s_addr = inet_addr(remote_ip);
-		remote.sin_port = htons(port);
+	if ((large = ring_dequeue(&w->handoff)) == NULL) {
+		// see again past the fence of rx_thread before sleeping
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if ((large = ring_dequeue(&w->handoff)) == NULL) return NULL;
+	}
+	w->lent--;
+	if ((packet = pool_fit(pool, large, hdr_len)) != large) {
+		ring_enqueue(&w->fill, large);
+		w->lent++;
+	}
+	rx_lend(w);
+	return packet;
+}
 
-		/* connection request */
-		if (connect(sock_fd, (struct sockaddr*) &remote, sizeof(remote)) < 0) {
-			perror("connect()");
+/**
+ * Takes the next whole [length][packet] frame received from the socket
+ * (with its virtio-net header when GSO is used), without blocking, in a
+ * packet of the smallest size class it fits in.
+ * In wire mode it takes the next frame captured on the second interface,
+ * its ethernet header is kept before data.
+ *
+ * @param[in]	rx reassembly ring of the socket (epoll engine)
+ * @param[in]	fd socket file descriptor
+ * @return		the packet, POOL_DROP(pool) if the pools are exhausted, NULL
+ *				if no whole frame is waiting
+ */
+packet_t *read_frame(rxring_t *rx, int fd)
+{
+	packet_t *packet;
+	uint16_t plength;
+	int n;
+
+	if (transport == TRANSPORT_WIRE) {
+		return read_sized(fd);
+	} else if (engine == ENGINE_URING) {
+		// the engine keeps the stream in its buffers, read it if a whole
+		// frame is there
+		if (!uring_frame_ready(&uring)) return NULL;
+		n = read_n(fd, (char *)&plength, sizeof(plength));
+		packet = pool_get_fit(pool, ntohs(plength));
+		if (n > 0) n = read_n(fd, (char *)packet->data - hdr_len, ntohs(plength) + hdr_len);
+		if (n == 0) {
+			my_err("Connection closed by peer\n");
 			exit(1);
 		}
-
-		net_fd = sock_fd;
-		do_debug("CLIENT: Connected to server %s\n", inet_ntoa(remote.sin_addr));
-    
 	} else {
-		/* Server, wait for connections */
-
-		/* avoid EADDRINUSE error on bind() */
-		if(setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, (char *)&optval, sizeof(optval)) < 0){
-			perror("setsockopt()");
-			exit(1);
-		}
+		if ((n = rxring_frame(rx, hdr_len)) < 0) return NULL;
+		packet = pool_get_fit(pool, n - hdr_len);
+		rxring_read(rx, (char *)&plength, sizeof(plength));
+		rxring_read(rx, (char *)packet->data - hdr_len, n);
+	}
+	packet->length = n - hdr_len;
+	packet->segs = vnet_len ? getSegments(packet->data, PKT_VNET(packet)->gso_size) : 1;
+	return packet;
+}
 
-		memset(&local, 0, sizeof(local));
-		local.sin_family = AF_INET;
-		local.sin_addr.s_addr = htonl(INADDR_ANY);
-		local.sin_port = htons(port);
-		if (bind(sock_fd, (struct sockaddr*) &local, sizeof(local)) < 0) {
-			perror("bind()");
-			exit(1);
-		}
+/**
+ * Tells if a packet is sent with MSG_ZEROCOPY
+ *
+ * @param	packet packet to send
+ * @return	1 if true 0 if false
+ */
+static int zc_large(packet_t *packet)
+{
+	return zc_threshold > 0 && packet->length + hdr_len >= zc_threshold;
+}
 
-		if (listen(sock_fd, 5) < 0){
-			perror("listen()");
-			exit(1);
+/**
+ * Writes a batch of [length][packet] frames to the socket and releases the
+ * packets. Runs of small frames go in a single writev, runs of frames of at
+ * least zc_threshold bytes in a single MSG_ZEROCOPY send, their packets
+ * being released when the kernel is done with them.
+ *
+ * @param[in]	zc frames waiting for their zerocopy completion
+ * @param[in]	fd socket file descriptor
+ * @param[in]	batch packets to send
+ * @param[in]	iov length and packet of every frame
+ * @param[in]	nbatch number of packets
+ * @return		number of written bytes
+ */
+int write_frames(zcopy_t *zc, int fd, packet_t **batch, struct iovec *iov, int nbatch)
+{
+	int k, i, end, nwrite = 0;
+
+	for (k = 0; k < nbatch; k = end) {
+		// a run of frames with the same kind of send
+		for (end = k + 1; end < nbatch && zc_large(batch[end]) == zc_large(batch[k]); end++);
+		if (zc_large(batch[k])) {
+			// the packets (and their length) are held until the kernel
+			// has sent them, then the completion releases them
+			for (i = k; i < end; i++)
+				iov[2*i].iov_base = zcopy_hold(zc, fd, batch[i], *(uint16_t *)iov[2*i].iov_base);
+			nwrite += zcopy_send(zc, fd, iov + 2*k, 2*(end - k));
+		} else {
+			nwrite += cwritev(fd, iov + 2*k, 2*(end - k));
+			for (i = k; i < end; i++)
+				free_packet(batch[i]);
 		}
+	}
+	return nwrite;
+}
 
-		/* wait for connection request */
-		remotelen = sizeof(remote);
-		memset(&remote, 0, remotelen);
-		if ((net_fd = accept(sock_fd, (struct sockaddr*)&remote, &remotelen)) < 0) {
-			perror("accept()");
-			exit(1);
-		}
+/**
+ * Receives up to BATCH_MAX datagrams, one packet each, with a single
+ * non-blocking recvmmsg. Empty slots of pkts are filled with large packets
+ * first and the received packets are left in the first slots.
+ *
+ * @param[in]		fd connected datagram socket
+ * @param[in,out]	pkts BATCH_MAX packets to receive in
+ * @return			number of received datagrams
+ */
+int read_datagrams(int fd, packet_t **pkts)
+{
+	struct mmsghdr msgs[BATCH_MAX];
+	struct iovec iov[BATCH_MAX];
+	int i, n;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < BATCH_MAX; i++) {
+		// a slot left with the drop packet tries the pool again
+		if (pkts[i] == NULL || pkts[i] == POOL_DROP(pool)) pkts[i] = pool_get(&pool[PKT_CLASSES - 1]);
+		iov[i].iov_base = (char *)pkts[i]->data - hdr_len;
+		iov[i].iov_len = PKT_LARGE + hdr_len;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	if ((n = recvmmsg(fd, msgs, BATCH_MAX, MSG_DONTWAIT, NULL)) < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNREFUSED)
+			return 0;
+		perror("Reading data");
+		exit(1);
+	}
+	for (i = 0; i < n; i++) {
+		pkts[i]->length = (int)msgs[i].msg_len - hdr_len;
+		pkts[i]->segs = 1;
+		if (vnet_len && pkts[i]->length > 0)
+			pkts[i]->segs = getSegments(pkts[i]->data, PKT_VNET(pkts[i])->gso_size);
+	}
+	return n;
+}
 
-		do_debug("SERVER: Client connected from %s\n", inet_ntoa(remote.sin_addr));
+/**
+ * Serves one tun/tap queue and its tunnel connection with its own Qtap/Qsock
+ * pair. Has the responsability of act accordingly to the scheduler event.
+ *
+ * @param	arg worker_t of the worker
+ * @return	NULL
+ */
+void *worker(void *arg)
+{
+	worker_t *w = (worker_t *) arg;
+	int tap_fd = w->tap_fd, net_fd = w->net_fd;
+	int nread, nwrite;
+	uint16_t plength;
+	unsigned long int tap2net = 0, net2tap = 0;
+	struct iovec iov[2*BATCH_MAX];
+	packet_t *batch[BATCH_MAX], *rcvd[BATCH_MAX];
+	pace_t pace;
+	uint16_t plengths[BATCH_MAX];
+	int nvec, nbatch, ndeq;
+	struct timeval now, depart;
+	rxring_t rx;
+	zcopy_t zc;
+	packet_t *dgrams[BATCH_MAX] = { NULL };
+	int n, npkts, large, reserve, slots, nrcvd;
+	/* bytes of the frame header sent before every packet */
+	int hdrlen = (transport == TRANSPORT_TCP) ? sizeof(plength) : 0;
+	char Qname[10];
+	cpu_set_t cpus;
+
+	if (w->cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(w->cpu, &cpus);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+			my_err("Could not pin worker %d to core %d\n", w->index, w->cpu);
+		do_debug("Worker %d pinned to core %d\n", w->index, w->cpu);
 	}
 
-	/* Create structures to keep packets */
+	/* Create structures to keep packets, with slots for as many pure ACKs
+	 * as their byte limit or shared buffer holds */
+	slots = max(QUEUE_SLOTS, max(queue_bytes, share_bytes)/PKT_SMALL);
 	/** * @var Qsock @brief queue to save packets arriving from socket */
 	pktqueue_t Qsock;
-	queue_init(&Qsock, 100, "Qsock");
+	snprintf(Qname, sizeof(Qname), w->index ? "Qsock%d" : "Qsock", w->index);
+	queue_init(&Qsock, slots, Qname);
+	if (queue_bytes > 0) queue_limit(&Qsock, queue_bytes, queue_bql);
+	if (share_bytes > 0) queue_share(&Qsock, &share);
+	queue_policy(&Qsock, sock_policy, free_packet);
+	queue_drain(&Qsock, T);
+	if (prio_bytes > 0) queue_prio(&Qsock, prio_bytes);
+	if (aqm_type[1] != NULL) queue_aqm(&Qsock, aqm_type[1], aqm_params[1], 0);
+	if (nclasses > 0) queue_classes(&Qsock, classes, nclasses);
 
 	/** @var Qtap @brief queue to save packets arriving from tap dev */         	
 	pktqueue_t Qtap;
-	queue_init(&Qtap, 100, "Qtap");
+	snprintf(Qname, sizeof(Qname), w->index ? "Qtap%d" : "Qtap", w->index);
+	queue_init(&Qtap, slots, Qname);
+	if (queue_bytes > 0) queue_limit(&Qtap, queue_bytes, queue_bql);
+	if (share_bytes > 0) queue_share(&Qtap, &share);
+	queue_policy(&Qtap, tap_policy, free_packet);
+	queue_drain(&Qtap, T);
+	if (prio_bytes > 0) queue_prio(&Qtap, prio_bytes);
+	// the backward congestion control reacts to the AQM instead of its drops
+	if (aqm_type[0] != NULL) queue_aqm(&Qtap, aqm_type[0], aqm_params[0], 1);
+	if (nclasses > 0) queue_classes(&Qtap, classes, nclasses);
+
+	/* every packet of the worker comes from its pools, unless -P sizes them:
+	 * small and medium packets for both queues, their bands and classes full,
+	 * the datagram slots, the landing packet, the dupack, the packets
+	 * waiting for their zerocopy completion and those lent to the RX
+	 * thread. Large ones for as many queued packets with
+	 * GSO, else for an eighth of them (jumbo frames), but at most QUEUE_SLOTS
+	 * per queue plus its byte bound (byte limit or shared buffer) in PKT_LARGE
+	 * packets: the queued large packets take about twice that bound rather
+	 * than 64 KB per slot. Queued packets smaller than PKT_LARGE can exhaust
+	 * the class before the bound, input is then dropped as in a full pool. The
+	 * datagram slots, the landing packet, the zerocopy and the lent ones come
+	 * on top */
+	npkts = queue_slots(&Qtap) + queue_slots(&Qsock);
+	large = min(vnet_len ? npkts : npkts/8,
+				2*(QUEUE_SLOTS + (int)(max(queue_bytes, share_bytes)/PKT_LARGE)));
+	reserve = BATCH_MAX + 2 + (zc_threshold > 0 ? ZC_MAX : 0) + (rx_threads ? RX_PACKETS : 0);
+	snprintf(Qname, sizeof(Qname), w->index ? "Pool%d" : "Pool", w->index);
+	pools_init(pool, pool_size > 0 ? pool_size : npkts + reserve,
+				pool_size > 0 ? pool_size : large + reserve, Qname, pool_pages);
 
   	packet_t *packet;
 	int j=0;
@@ -628,60 +1264,146 @@ int main(int argc, char *argv[])
     // Disable schedule sending time on both queues 
 	qtap_next_pkt_out.tv_sec = -1;
 	qsock_next_pkt_out.tv_sec = -1;
+	wire = w->wire;
+	xsk = w->xsk;
+	if (engine == ENGINE_URING) {
+		if (uring_init(&uring, tap_fd, net_fd) < 0) {
+			my_err("io_uring engine not available\n");
+			exit(1);
+		}
+	} else if (rx_threads) {
+		// tun/tap is read by the RX thread, which hands the packets over
+		snprintf(Qname, sizeof(Qname), w->index ? "Rx%d" : "Rx", w->index);
+		ring_init(&w->handoff, RX_PACKETS, Qname);
+		snprintf(Qname, sizeof(Qname), w->index ? "Fill%d" : "Fill", w->index);
+		ring_init(&w->fill, RX_PACKETS, Qname);
+		w->lent = 0;
+		w->rxdrops = 0;
+		rx_lend(w);
+		if ((w->rx_efd = eventfd(0, 0)) < 0) {
+			perror("eventfd()");
+			exit(1);
+		}
+		io_init(w->rx_efd, net_fd);
+		if (pthread_create(&w->rx, NULL, rx_thread, w) != 0) {
+			my_err("Could not start the RX thread of worker %d\n", w->index);
+			exit(1);
+		}
+	} else {
+		io_init(tap_fd, net_fd);
+	}
+	if (engine == ENGINE_EPOLL && transport == TRANSPORT_TCP) rxring_init(&rx, RXRING_SIZE);
+	if (zc_threshold > 0 && zcopy_init(&zc, net_fd, free_packet) < 0) {
+		my_err("MSG_ZEROCOPY not available\n");
+		exit(1);
+	}
 
 	/** @var trigger_seq @brief is the sequence that triggered the mechanism */
 	unsigned int trigger_seq = -1;
+	/** @var seq @brief sequence of the packet read from tun/tap, taken before it can be released */
+	unsigned int seq;
 
-	packet_t *dupack;
+	packet_t *dupack = NULL;
 	int in_backward_cc= -1;
 	unsigned short pkt_count= 0;
-	int i;
+	int i, k;
 	char *ptr;
+	char dupack_buf[BUFSIZE];
 
 	while(1) {
-		j=io_timeout (tap_fd,net_fd);
+		j=io_timeout ();
 		if ( j & FDTAP_IN_RDY) {
 			do_debug("Ready to read data in tap interface\n");
-			// Allocate memory for new packet
-			packet = (packet_t *) malloc(sizeof(packet_t));
-			// Read packet from tap to the packet structure
-			nread = cread(tap_fd, packet->data, BUFSIZE);
-			packet->length = nread;
-			tap2net++;
-			do_debug("TAP2NET %lu: Read %d bytes from the tap interface\n", tap2net, nread);
-			if (in_backward_cc == -3) pkt_count++; //Count packets
-			// Enqueue packet in Qtap if its not the retransmission
-			if (getTCPSeq(packet->data) == trigger_seq){
-				free(packet);
-				do_debug("Stop retransmission\n");
-			} else if (enqueue_packet(&Qtap, packet) == 0) {
-				//Queue full -> Drop packet
-				free(packet);
-			}
-			if ((Qtap.fullness > 20) && (in_backward_cc == -1)) {
-				trigger_seq= getTCPSeq(packet->data);
-				do_debug("Backward Congestion initiation\n");
-				do_debug("trigger_seq= %u\n", trigger_seq);
-				in_backward_cc= -2;
+			// tun/tap gives one packet per read, in wire mode every frame
+			// of the receive ring is taken, and every packet the RX thread
+			// handed over
+			while (1) {
+				if (transport == TRANSPORT_XDP) {
+					// the packet stays in the UMEM frame it was received in
+					if ((packet = xdp_read(tap_fd)) == NULL) break;
+					nread = packet->length + hdr_len;
+				} else if (rx_threads) {
+					if ((packet = read_handoff(w)) == NULL) break;
+					nread = packet->length + hdr_len;
+				} else {
+					// Read packet (and its virtio-net or ethernet header) from tap
+					// to the smallest packet it fits in
+					if ((packet = read_sized(tap_fd)) == NULL) break;
+					nread = packet->length + hdr_len;
+				}
+				tap2net++;
+				do_debug("TAP2NET %lu: Read %d bytes from the tap interface\n", tap2net, nread);
+				if (in_backward_cc == -3) pkt_count += packet->segs; //Count packets (segments)
+				seq = getTCPSeq(packet->data);
+				// Enqueue packet in Qtap if its not the retransmission
+				if (packet == POOL_DROP(pool)) {
+					//Pool exhausted -> Drop packet
+					do_debug("Packet dropped\n");
+				} else if (seq == trigger_seq){
+					free_packet(packet);
+					do_debug("Stop retransmission\n");
+				} else if (enqueue_packet(&Qtap, packet) == 0) {
+					//Queue full -> Drop packet
+					free_packet(packet);
+				}
+				// the packet can be released by now, its sequence was taken before
+				if ((aqm_type[0] != NULL ? queue_signal(&Qtap) : Qtap.segfullness > 20) && (in_backward_cc == -1)
+						&& packet != POOL_DROP(pool)) {
+					trigger_seq= seq;
+					do_debug("Backward Congestion initiation\n");
+					do_debug("trigger_seq= %u\n", trigger_seq);
+					in_backward_cc= -2;
+				}
+				if (transport < TRANSPORT_WIRE && !rx_threads) break;
 			}
 		}
 
 		if ( j & FDSOCK_IN_RDY) {
 			do_debug("Ready to read data in socket\n");
-			// Allocate memory for new packet
-			packet = (packet_t *) malloc(sizeof(packet_t));
-			/* data from the network: read it.
-			 * We need to read the length first, and then the packet */
-			/* Read length */      
-			nread = read_n(net_fd, (char *)&plength, sizeof(plength));      
-			/* read packet */
-			nread = read_n(net_fd, packet->data, ntohs(plength));
-			packet->length = nread;			
-			do_debug("NET2TAP %lu: Read %d bytes from the network\n", net2tap, nread);
-			// Enqueue packet in Qsock
-			if (enqueue_packet(&Qsock, packet) == 0) {
-				//Queue full -> Drop packet
-				free(packet);
+			/* data from the network: pull everything available with one
+			 * non-blocking read into the reassembly ring, then take every
+			 * whole [length][packet] frame. A partial frame stays in the
+			 * ring until the rest arrives, so it never stalls the loop */
+			// release the packets the kernel is done sending (zerocopy
+			// completions wake us as socket errors)
+			if (zc_threshold > 0) zcopy_reap(&zc, net_fd);
+			if (transport == TRANSPORT_UDP) {
+				// one packet per datagram, a batch of them per read
+				n = read_datagrams(net_fd, dgrams);
+				for (k = nrcvd = 0; k < n; k++) {
+					if (dgrams[k]->length <= 0) continue;	// connection datagram
+					// a copy in a smaller class leaves the slot its packet
+					packet = pool_fit(pool, dgrams[k], hdr_len);
+					if (packet == dgrams[k]) dgrams[k] = NULL;
+					do_debug("NET2TAP %lu: Read %d bytes from the network\n", net2tap, packet->length);
+					//Pool exhausted -> Drop packet
+					if (packet != POOL_DROP(pool)) rcvd[nrcvd++] = packet;
+				}
+				// Enqueue the packets in Qsock at once
+				for (k = enqueue_batch(&Qsock, rcvd, nrcvd); k < nrcvd; k++) {
+					//Queue full -> Drop packet
+					free_packet(rcvd[k]);
+				}
+			} else {
+				if (transport == TRANSPORT_TCP && engine == ENGINE_EPOLL && rxring_fill(&rx, net_fd) == 0) {
+					my_err("Connection closed by peer\n");
+					exit(1);
+				}
+				while (1) {
+					if (transport == TRANSPORT_XDP) {
+						if ((packet = xdp_read(net_fd)) == NULL) break;
+						nread = packet->length;
+					} else {
+						if ((packet = read_frame(&rx, net_fd)) == NULL) break;
+						nread = packet->length;
+					}
+					do_debug("NET2TAP %lu: Read %d bytes from the network\n", net2tap, nread);
+					// Enqueue packet in Qsock
+					if (packet == POOL_DROP(pool) || enqueue_packet(&Qsock, packet) == 0) {
+						//Pool exhausted or queue full -> Drop packet
+						free_packet(packet);
+					}
+				}
 			}
 		}
 
@@ -701,16 +1423,20 @@ int main(int argc, char *argv[])
 							dupack = packet;
 							in_backward_cc++;
 						  	do_debug("Backward Congestion initiation\n");
-							nwrite= cwrite(tap_fd, packet->data, packet->length);
+							nwrite= cwrite(tap_fd, (char *)packet->data - hdr_len, packet->length + hdr_len);
+						} else {
+							free_packet(packet);
 						}
 					//Send last DUPACK
 					} else if (getACKSeq(packet->data) >= trigger_seq && trigger_seq != -1) {
 						do_debug("Terminando cc: %u\n", getACKSeq(dupack->data));
-						nwrite = cwrite(tap_fd, packet->data, packet->length);
+						nwrite = cwrite(tap_fd, (char *)packet->data - hdr_len, packet->length + hdr_len);
 						trigger_seq = -1;
 						in_backward_cc = -1;
 						pkt_count = 0;
-						free(dupack);
+						free_packet(dupack);
+						dupack = NULL;
+						free_packet(packet);
 						do_debug("NET2TAP %lu: Written %d bytes to the tap interface\n", net2tap, nwrite);
 					//Send DUPACKS
 					} else {
@@ -718,9 +1444,15 @@ int main(int argc, char *argv[])
 
 						for (i= 0; i<pkt_count; i++) {
 							ptr= create_dupack(dupack->data, (in_backward_cc*pkt_count)-pkt_count+i+1, getTimestampVal(packet->data));
-							nwrite= cwrite(tap_fd, ptr, dupack->length);
+							// dupacks carry the ethernet header of the ack in wire
+							// mode, and a full checksum, so an empty virtio-net header
+							memcpy(dupack_buf, (char *)dupack->data - hdr_len, hdr_len);
+							memset(dupack_buf, 0, vnet_len);
+							memcpy(dupack_buf + hdr_len, ptr, dupack->length);
+							nwrite= cwrite(tap_fd, dupack_buf, dupack->length + hdr_len);
 						}
 						i = 0;
+						free_packet(packet);
 
 						in_backward_cc++;
 					}
@@ -734,29 +1466,506 @@ int main(int argc, char *argv[])
 					qsock_next_pkt_out.tv_sec = -1;
 				}else {
 					if (in_backward_cc == -2) in_backward_cc = -3; //Wait for the return ACK to count packets
-					nwrite = cwrite(tap_fd, packet->data, packet->length);
-					if (in_backward_cc == -1) free(packet);
+					nwrite = cwrite(tap_fd, (char *)packet->data - hdr_len, packet->length + hdr_len);
+					io_pace(&qsock_next_pkt_out, packet->segs);
+					free_packet(packet);
 					do_debug("NET2TAP %lu: Written %d bytes to the tap interface\n", net2tap, nwrite);
 				}
 			}
+			queue_tick(&Qsock);
 		}
 
 
 		if ( j & FDSOCK_OUT_OK) {
 			do_debug("Ready to write data to socket\n");
-			//Time to send packet to sock
-			//Try to dequeue packet from Qtap
-			if ((packet = dequeue_packet(&Qtap)) == NULL) {
+			//Time to send packets to sock
+			//Gather every packet of Qtap whose departure time (T per segment
+			//after the scheduled time) has come in a single write, up to
+			//BATCH_MAX packets and batch_bytes bytes
+			//(every packet is a datagram with udp, no length is sent)
+			gettimeofday(&now, NULL);
+			nvec = nbatch = 0;
+			//The queue checks the limits on the packets it actually takes,
+			//after its AQM and schedulers chose them
+			pace.now = now;
+			pace.depart = qtap_due;
+			pace.usecs = T;
+			pace.budget = batch_bytes;
+			pace.overhead = hdrlen + hdr_len;
+			pace.bytes = 0;
+			ndeq = dequeue_batch(&Qtap, batch, BATCH_MAX, &pace);
+			depart = pace.depart;
+			for (k = 0; k < ndeq; k++) {
+				packet = batch[k];
+				if (transport == TRANSPORT_TCP) {
+					plengths[nbatch] = htons(packet->length);
+					iov[nvec].iov_base = &plengths[nbatch];
+					iov[nvec++].iov_len = sizeof(plength);
+				}
+				iov[nvec].iov_base = (char *)packet->data - hdr_len;
+				iov[nvec++].iov_len = packet->length + hdr_len;
+				batch[nbatch++] = packet;
+			}
+			if (ndeq == 0) {
 				//Queue is empty, disable next sending time until new packet arrives
 				qtap_next_pkt_out.tv_sec = -1;
 			} else {
-				plength = htons(packet->length);
-      			nwrite = cwrite(net_fd, (char *)&plength, sizeof(plength));
-				nwrite = cwrite(net_fd, packet->data, packet->length);
-				free(packet);
-				do_debug("TAP2NET %lu: Written %d bytes to the socket\n", tap2net, nwrite);
+				if (nbatch > 0) {
+					if (transport == TRANSPORT_UDP) {
+						nwrite = csendmmsg(net_fd, iov, nvec);
+						for (k = 0; k < nbatch; k++)
+							free_packet(batch[k]);
+					} else if (transport >= TRANSPORT_WIRE) {
+						// queued in the transmit ring, sent together by io_timeout
+						for (k = nwrite = 0; k < nbatch; k++) {
+							nwrite += cwrite(net_fd, iov[k].iov_base, iov[k].iov_len);
+							free_packet(batch[k]);
+						}
+					} else {
+						nwrite = write_frames(&zc, net_fd, batch, iov, nbatch);
+					}
+					do_debug("TAP2NET %lu: Written %d bytes (%d packets) to the socket\n", tap2net, nwrite, nbatch);
+				}
+				//Next packet departs when its turn comes, or now if we are late
+				qtap_next_pkt_out = timercmp(&depart, &now, <) ? now : depart;
 			}
+			queue_tick(&Qtap);
 		}
 	}  
+	return(NULL);
+}
+
+/**
+ * Client side of the UDP connection: announces the connected datagram socket
+ * to the server until it answers
+ *
+ * @param	fd datagram socket connected to the server
+ */
+void udp_hello(int fd)
+{
+	struct timeval tv;
+	int i;
+
+	for (i = 0; i < 10; i++) {
+		// an empty datagram asks for (and answers) the connection
+		if (send(fd, NULL, 0, 0) < 0 && errno != ECONNREFUSED) {
+			perror("send()");
+			exit(1);
+		}
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		if (recv(fd, NULL, 0, 0) == 0) {
+			tv.tv_sec = 0;
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+			return;
+		}
+	}
+	my_err("No answer from server\n");
+	exit(1);
+}
+
+/**
+ * Server side of the UDP connection: waits for a new client socket on lsock
+ * and returns a datagram socket bound to the same port and connected to it
+ *
+ * @param	lsock datagram socket bound to the server port
+ * @param	local server address
+ * @param	peers client sockets already accepted
+ * @param	npeers number of client sockets already accepted
+ * @return	connected datagram socket
+ */
+int udp_accept(int lsock, struct sockaddr_in *local, struct sockaddr_in *peers, int npeers)
+{
+	struct sockaddr_in remote;
+	socklen_t remotelen;
+	int i, fd, optval = 1;
+
+	// wait for the empty datagram of a client socket we do not know yet
+	do {
+		remotelen = sizeof(remote);
+		if (recvfrom(lsock, NULL, 0, 0, (struct sockaddr*)&remote, &remotelen) < 0) {
+			perror("recvfrom()");
+			exit(1);
+		}
+		for (i = 0; i < npeers; i++)
+			if (peers[i].sin_addr.s_addr == remote.sin_addr.s_addr &&
+					peers[i].sin_port == remote.sin_port) break;
+	} while (i < npeers);
+	peers[npeers] = remote;
+
+	// a socket connected to it on the same port takes its datagrams
+	if ( (fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		perror("socket()");
+		exit(1);
+	}
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0 ||
+			setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+		perror("setsockopt()");
+		exit(1);
+	}
+	if (bind(fd, (struct sockaddr*) local, sizeof(*local)) < 0) {
+		perror("bind()");
+		exit(1);
+	}
+	if (connect(fd, (struct sockaddr*) &remote, sizeof(remote)) < 0) {
+		perror("connect()");
+		exit(1);
+	}
+	if (send(fd, NULL, 0, 0) < 0) {
+		perror("send()");
+		exit(1);
+	}
+	return fd;
+}
+
+/**
+ * The core of the program. Has the responsability of act accordingly to the
+ * scheduler event and setting up the initial variables and structures
+ * depending if it acts as a server or a client
+ *
+ * @param	argc An integer argument count of the command line arguments
+ * @param	argv An argument vector of the command line arguments
+ * @return	0
+ */
+int main(int argc, char *argv[])
+{
+	int option;
+	int flags = IFF_TUN;
+	char if_name[IFNAMSIZ] = "";
+	char wire_if[IFNAMSIZ] = "";
+	int header_len = IP_HDR_LEN;
+	int maxfd;
+	char buffer[BUFSIZE];
+	struct sockaddr_in local, remote;
+	char remote_ip[16] = "";
+	unsigned short int port = PORT;
+	int sock_fd, optval = 1;
+	socklen_t remotelen;
+	int cliserv = -1;    /* must be specified on cmd line */
+	worker_t w[MAX_QUEUES];
+	int q, nqueues = 1;
+	int mtu;
+	struct sockaddr_in peers[MAX_QUEUES];
+	int mapfd[2];
+	char *policy;
+	int naqm = 0;
+
+ 	progname = argv[0];
+	tap_policy = sock_policy = drop_policy("tail");
+	
+  
+	/* Check command line options */
+	while((option = getopt(argc, argv, "i:sc:p:uae:q:rgb:t:z:w:x:P:H:l:L:S:A:D:k:Q:C:hd")) > 0){
+		switch(option) {
+		case 'd':
+        	debug = 1;
+        	break;
+		case 'h':
+			usage();
+			break;
+		case 'i':
+			strncpy(if_name, optarg, IFNAMSIZ-1);
+			break;
+		case 's':
+			cliserv = SERVER;
+			break;
+		case 'c':
+			cliserv = CLIENT;
+			strncpy(remote_ip, optarg,15);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'u':
+			flags = IFF_TUN;
+			break;
+		case 'a':
+			flags = IFF_TAP;
+			header_len = ETH_HDR_LEN;
+			break;
+		case 'q':
+			nqueues = atoi(optarg);
+			if (nqueues < 1 || nqueues > MAX_QUEUES) {
+				my_err("Number of queues must be between 1 and %d\n", MAX_QUEUES);
+				usage();
+			}
+			break;
+		case 't':
+			if (strcmp(optarg, "udp") == 0) transport = TRANSPORT_UDP;
+			else if (strcmp(optarg, "tcp") == 0) transport = TRANSPORT_TCP;
+			else {
+				my_err("Unknown transport %s\n", optarg);
+				usage();
+			}
+			break;
+		case 'z':
+			zc_threshold = atoi(optarg);
+			break;
+		case 'w':
+			strncpy(wire_if, optarg, IFNAMSIZ-1);
+			transport = TRANSPORT_WIRE;
+			break;
+		case 'x':
+			strncpy(wire_if, optarg, IFNAMSIZ-1);
+			transport = TRANSPORT_XDP;
+			break;
+		case 'b':
+			batch_bytes = atoi(optarg);
+			break;
+		case 'l':
+		case 'L':
+			queue_bytes = atoi(optarg);
+			queue_bql = (option == 'L');
+			break;
+		case 'S':
+			share_bytes = atol(optarg);
+			break;
+		case 'A':
+			share_alpha = atof(optarg);
+			break;
+		case 'D':
+			if ((policy = strchr(optarg, ',')) != NULL) *policy++ = '\0';
+			tap_policy = drop_policy(optarg);
+			sock_policy = policy ? drop_policy(policy) : tap_policy;
+			if (tap_policy == NULL || sock_policy == NULL) {
+				my_err("Unknown drop policy %s\n", tap_policy ? policy : optarg);
+				usage();
+			}
+			break;
+		case 'Q':
+			// the first one for both queues, the next ones for the socket queue
+			if ((aqm_params[naqm] = strchr(optarg, ',')) != NULL) *aqm_params[naqm]++ = '\0';
+			if ((aqm_type[naqm] = aqm_find(optarg)) == NULL && strcmp(optarg, "none") != 0) {
+				my_err("Unknown AQM %s\n", optarg);
+				usage();
+			}
+			if (naqm == 0) {
+				aqm_type[1] = aqm_type[0];
+				aqm_params[1] = aqm_params[0];
+			}
+			naqm = 1;
+			break;
+		case 'C':
+			if (nclasses == CLASS_MAX || class_parse(&classes[nclasses], optarg) < 0) {
+				my_err("Bad traffic class %s\n", optarg);
+				usage();
+			}
+			nclasses++;
+			break;
+		case 'k':
+			prio_bytes = atoi(optarg);
+			break;
+		case 'P':
+			pool_size = atoi(optarg);
+			break;
+		case 'H':
+			if (strcmp(optarg, "hugetlb") == 0) pool_pages = POOL_PAGES_HUGETLB;
+			else if (strcmp(optarg, "thp") == 0) pool_pages = POOL_PAGES_THP;
+			else if (strcmp(optarg, "normal") == 0) pool_pages = POOL_PAGES_NORMAL;
+			else {
+				my_err("Unknown pages %s\n", optarg);
+				usage();
+			}
+			break;
+		case 'r':
+			rx_threads = 1;
+			break;
+		case 'g':
+			vnet_len = sizeof(struct virtio_net_hdr);
+			break;
+		case 'e':
+			if (strcmp(optarg, "uring") == 0) engine = ENGINE_URING;
+			else if (strcmp(optarg, "epoll") == 0) engine = ENGINE_EPOLL;
+			else {
+				my_err("Unknown engine %s\n", optarg);
+				usage();
+			}
+			break;
+		default:
+			my_err("Unknown option %c\n", option);
+			usage();
+		}
+	}
+
+	argv += optind;
+	argc -= optind;
+
+	if (argc > 0) {
+		my_err("Too many options!\n");
+		usage();
+	}
+
+	if (*if_name == '\0') {
+		my_err("Must specify interface name!\n");
+		usage();
+	} else if (transport >= TRANSPORT_WIRE && (cliserv >= 0 || vnet_len || engine == ENGINE_URING || zc_threshold > 0)) {
+		my_err("The wire mode supports neither client/server mode, GSO, the io_uring engine nor MSG_ZEROCOPY!\n");
+		usage();
+	} else if (cliserv < 0 && transport < TRANSPORT_WIRE) {
+		my_err("Must specify client or server mode!\n");
+		usage();
+	} else if ((cliserv == CLIENT)&&(*remote_ip == '\0')) {
+		my_err("Must specify server address!\n");
+		usage();
+	} else if (vnet_len && (flags & IFF_TAP)) {
+		my_err("GSO is only supported in tun mode!\n");
+		usage();
+	} else if (vnet_len && engine == ENGINE_URING) {
+		my_err("GSO is not supported by the io_uring engine!\n");
+		usage();
+	} else if (transport == TRANSPORT_UDP && (vnet_len || engine == ENGINE_URING)) {
+		my_err("The udp transport supports neither GSO nor the io_uring engine!\n");
+		usage();
+	} else if (zc_threshold > 0 && (transport == TRANSPORT_UDP || engine == ENGINE_URING)) {
+		my_err("MSG_ZEROCOPY needs the tcp transport and the epoll engine!\n");
+		usage();
+	} else if (rx_threads && (transport >= TRANSPORT_WIRE || engine == ENGINE_URING)) {
+		my_err("The RX thread needs a tun/tap device and the epoll engine!\n");
+		usage();
+	}
+
+	hdr_len = (transport >= TRANSPORT_WIRE) ? ETH_HDR_LEN : vnet_len;
+	if (share_bytes > 0) share_init(&share, share_bytes, share_alpha);
+
+	if (transport == TRANSPORT_XDP) {
+		/* the AF_XDP sockets on queue q of both interfaces share the UMEM
+		 * of worker q, the XDP program of each interface hands them the
+		 * frames of their queue */
+		mapfd[0] = xsk_attach(if_name, nqueues);
+		mapfd[1] = xsk_attach(wire_if, nqueues);
+		for (q = 0; q < nqueues; q++) {
+			xsk_umem_init(&w[q].umem);
+			w[q].tap_fd = xsk_open(&w[q].xsk[0], &w[q].umem, if_name, q, mapfd[0], NULL);
+			w[q].net_fd = xsk_open(&w[q].xsk[1], &w[q].umem, wire_if, q, mapfd[1], &w[q].xsk[0]);
+		}
+
+		do_debug("XDP: bridging %s and %s (%d queues)\n", if_name, wire_if, nqueues);
+	} else if (transport == TRANSPORT_WIRE) {
+		/* packet rings on both interfaces take the place of the tun/tap
+		 * device and the tunnel, one pair per worker sharing the traffic
+		 * by flow */
+		for (q = 0; q < nqueues; q++) {
+			w[q].tap_fd = wire_open(&w[q].wire[0], if_name, nqueues > 1);
+			w[q].net_fd = wire_open(&w[q].wire[1], wire_if, nqueues > 1);
+		}
+
+		do_debug("WIRE: bridging %s and %s (%d queues)\n", if_name, wire_if, nqueues);
+	} else {
+		/* initialize tun/tap interface, one queue per worker */
+		for (q = 0; q < nqueues; q++) {
+			if ( (w[q].tap_fd = tun_alloc(if_name, flags | IFF_NO_PI | (nqueues > 1 ? IFF_MULTI_QUEUE : 0) | (vnet_len ? IFF_VNET_HDR : 0))) < 0 ) {
+				my_err("Error connecting to tun/tap interface %s!\n", if_name);
+				exit(1);
+			}
+		}
+
+		do_debug("Successfully connected to interface %s (%d queues)\n", if_name, nqueues);
+
+		/* the io_uring buffers and write slots hold a frame of URING_BUFSIZE
+		 * bytes at most, larger ones sent by a peer are dropped */
+		if (engine == ENGINE_URING &&
+			(mtu = if_mtu(if_name)) + ((flags & IFF_TAP) ? ETH_HDR_LEN : 0) > URING_BUFSIZE) {
+			my_err("The io_uring engine takes frames of up to %d bytes, %s has an MTU of %d!\n",
+					URING_BUFSIZE, if_name, mtu);
+			exit(1);
+		}
+	}
+
+	if(cliserv==CLIENT) {
+		/* Client, try to connect to server */
+
+		/* assign the destination address */
+		memset(&remote, 0, sizeof(remote));
+		remote.sin_family = AF_INET;
+		remote.sin_addr.s_addr = inet_addr(remote_ip);
+		remote.sin_port = htons(port);
+
+		/* connection request, one connection per queue */
+		for (q = 0; q < nqueues; q++) {
+			if ( (sock_fd = socket(AF_INET, transport == TRANSPORT_UDP ? SOCK_DGRAM : SOCK_STREAM, 0)) < 0) {
+				perror("socket()");
+				exit(1);
+			}
+			if (connect(sock_fd, (struct sockaddr*) &remote, sizeof(remote)) < 0) {
+				perror("connect()");
+				exit(1);
+			}
+			if (transport == TRANSPORT_UDP) udp_hello(sock_fd);
+			w[q].net_fd = sock_fd;
+		}
+
+		do_debug("CLIENT: Connected to server %s\n", inet_ntoa(remote.sin_addr));
+    
+	} else if (cliserv == SERVER) {
+		/* Server, wait for connections */
+
+		if ( (sock_fd = socket(AF_INET, transport == TRANSPORT_UDP ? SOCK_DGRAM : SOCK_STREAM, 0)) < 0) {
+			perror("socket()");
+			exit(1);
+		}
+
+		/* avoid EADDRINUSE error on bind() */
+		if(setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, (char *)&optval, sizeof(optval)) < 0){
+			perror("setsockopt()");
+			exit(1);
+		}
+		/* with udp every client socket gets its own socket on the same port */
+		if (transport == TRANSPORT_UDP &&
+			setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, (char *)&optval, sizeof(optval)) < 0) {
+			perror("setsockopt()");
+			exit(1);
+		}
+
+		memset(&local, 0, sizeof(local));
+		local.sin_family = AF_INET;
+		local.sin_addr.s_addr = htonl(INADDR_ANY);
+		local.sin_port = htons(port);
+		if (bind(sock_fd, (struct sockaddr*) &local, sizeof(local)) < 0) {
+			perror("bind()");
+			exit(1);
+		}
+
+		if (transport == TRANSPORT_UDP) {
+			/* wait for the client sockets, the client opens one per queue */
+			for (q = 0; q < nqueues; q++)
+				w[q].net_fd = udp_accept(sock_fd, &local, peers, q);
+			remote = peers[nqueues - 1];
+			close(sock_fd);
+		} else {
+			if (listen(sock_fd, max(5, nqueues)) < 0){
+				perror("listen()");
+				exit(1);
+			}
+
+			/* wait for connection requests, the client opens one per queue */
+			for (q = 0; q < nqueues; q++) {
+				remotelen = sizeof(remote);
+				memset(&remote, 0, remotelen);
+				if ((w[q].net_fd = accept(sock_fd, (struct sockaddr*)&remote, &remotelen)) < 0) {
+					perror("accept()");
+					exit(1);
+				}
+			}
+		}
+
+		do_debug("SERVER: Client connected from %s\n", inet_ntoa(remote.sin_addr));
+	}
+
+	/* Start the workers. Worker q serves tun/tap queue q and connection q.
+	 * The kernel steers every flow to the tun/tap queue its return packets
+	 * are written to, and the peer does the same with our connection q, so
+	 * both directions of a flow stay in the same worker and its Qtap/Qsock
+	 * pair (and the congestion logic) see the whole flow. */
+	for (q = 0; q < nqueues; q++) {
+		w[q].index = q;
+		w[q].cpu = (nqueues > 1) ? q % sysconf(_SC_NPROCESSORS_ONLN) : -1;
+		if (q > 0 && pthread_create(&w[q].thread, NULL, worker, &w[q]) != 0) {
+			my_err("Could not start worker %d\n", q);
+			exit(1);
+		}
+	}
+	/* the main thread is worker 0 */
+	worker(&w[0]);
 	return(0);
 }
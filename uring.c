@@ -0,0 +1,593 @@
+/**
+ * @file	uring.c
+ * @authors	simpletun contributors
+ * @date	October 2026
+ * @license GNU GPL	v3
+ * @brief	io_uring engine for the tap and socket I/O
+ *
+ * Reads from tap and socket are multishot requests picking their buffers
+ * from a registered buffer ring, so in steady state nothing has to be
+ * submitted to keep receiving. Writes are copied to a slot and submitted
+ * (length prefix and payload as linked requests on the socket) with the
+ * next io_uring_enter, which is also the call that waits for events.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h> /* exit() */
+#include <arpa/inet.h> /* ntohs() */
+
+#include "uring.h"
+
+#undef max
+#define max(x,y) ((x) > (y) ? (x) : (y))
+#undef min
+#define min(x,y) ((x) < (y) ? (x) : (y))
+
+/* Multishot read (Linux 6.7), not in every linux/io_uring.h */
+#define URING_OP_READ_MULTISHOT	49
+
+/* Buffer groups */
+#define TAP		0
+#define SOCK	1
+
+/* Request types, saved in the low byte of user_data */
+#define OP_TAP_READ		1
+#define OP_SOCK_RECV	2
+#define OP_TAP_WRITE	3
+#define OP_SOCK_WRITE	4
+
+void do_debug(char *msg, ...);
+
+/**
+ * Exits printing the error of a completion, like cread/cwrite do
+ *
+ * @brief	Exits on a failed request
+ * @param	msg Message to print
+ * @param	res Result of the completion (-errno)
+ *
+ */
+static void uring_fatal(char *msg, int res) {
+	errno = -res;
+	perror(msg);
+	exit(1);
+}
+
+/**
+ * Gets an empty submission queue entry, submitting the queued ones first
+ * if the queue is full
+ *
+ * @brief	Gets a submission queue entry
+ * @param	u io_uring instance
+ * @param	opcode Request operation
+ * @param	fd File descriptor of the request
+ * @param	user_data Request type and write slot
+ * @return	Submission queue entry
+ *
+ */
+static struct io_uring_sqe *uring_sqe(uring_t *u, int opcode, int fd, uint64_t user_data) {
+	struct io_uring_sqe *sqe;
+	unsigned tail, idx;
+
+	tail = *u->sq_tail;
+	if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) > *u->sq_mask) {
+		if (syscall(__NR_io_uring_enter, u->fd, tail - *u->sq_head, 0, 0, NULL, 0) < 0) {
+			perror("io_uring_enter()");
+			exit(1);
+		}
+	}
+	idx = tail & *u->sq_mask;
+	sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->user_data = user_data;
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+/**
+ * Gives a buffer back to its provided buffer ring
+ *
+ * @brief	Recycles a provided buffer
+ * @param	u io_uring instance
+ * @param	g Buffer group (TAP or SOCK)
+ * @param	bid Buffer id
+ *
+ */
+static void uring_recycle(uring_t *u, int g, uint16_t bid) {
+	struct io_uring_buf *buf;
+	uint16_t tail = u->br[g]->tail;
+
+	buf = &u->br[g]->bufs[tail & (URING_NBUFS-1)];
+	buf->addr = (uint64_t)(uintptr_t)(u->bufs[g] + bid*URING_BUFSIZE);
+	buf->len = URING_BUFSIZE;
+	buf->bid = bid;
+	__atomic_store_n(&u->br[g]->tail, tail + 1, __ATOMIC_RELEASE);
+	u->avail[g]++;
+}
+
+/**
+ * Arms the tap and socket reads again if they were terminated (no buffers
+ * left or a one-shot read completed) and their ring has buffers again
+ *
+ * @brief	Arms the reads
+ * @param	u io_uring instance
+ *
+ */
+static void uring_arm(uring_t *u) {
+	struct io_uring_sqe *sqe;
+
+	if (!u->armed[TAP] && u->avail[TAP] > 0) {
+		if (u->oneshot_tap) {
+			sqe = uring_sqe(u, IORING_OP_READ, u->fdtap, OP_TAP_READ);
+			sqe->len = URING_BUFSIZE;
+		} else {
+			sqe = uring_sqe(u, URING_OP_READ_MULTISHOT, u->fdtap, OP_TAP_READ);
+		}
+		sqe->off = -1;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = TAP;
+		u->armed[TAP] = 1;
+	}
+	if (!u->armed[SOCK] && u->avail[SOCK] > 0 && !u->eof) {
+		sqe = uring_sqe(u, IORING_OP_RECV, u->fdsock, OP_SOCK_RECV);
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = SOCK;
+		u->armed[SOCK] = 1;
+	}
+}
+
+/**
+ * Submits the socket writes waiting in the backlog as one linked chain,
+ * provided the previous chain has completed
+ *
+ * @brief	Submits the waiting socket writes
+ * @param	u io_uring instance
+ *
+ */
+static void uring_chain(uring_t *u) {
+	struct io_uring_sqe *sqe = NULL;
+	int s;
+
+	if (u->sock_inflight > 0) return;
+	while (u->backlog_count > 0) {
+		if (sqe != NULL) sqe->flags |= IOSQE_IO_LINK;
+		s = u->backlog[u->backlog_front];
+		u->backlog_front = (u->backlog_front + 1)%URING_NSLOTS;
+		u->backlog_count--;
+		sqe = uring_sqe(u, IORING_OP_SEND, u->fdsock, OP_SOCK_WRITE | (s << 8));
+		sqe->addr = (uint64_t)(uintptr_t)u->slot[s].data;
+		sqe->len = u->slot[s].length;
+		sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+		u->sock_inflight++;
+	}
+}
+
+/**
+ * Processes a completion queue entry
+ *
+ * @brief	Processes a completion
+ * @param	u io_uring instance
+ * @param	cqe Completion queue entry
+ *
+ */
+static void uring_complete(uring_t *u, struct io_uring_cqe *cqe) {
+	int op = cqe->user_data & 0xff;
+	int s = cqe->user_data >> 8;
+	int g = (op == OP_TAP_READ) ? TAP : SOCK;
+	uring_chunk_t *c;
+
+	switch (op) {
+	case OP_TAP_READ:
+	case OP_SOCK_RECV:
+		if (!(cqe->flags & IORING_CQE_F_MORE)) u->armed[g] = 0;
+		if (cqe->res < 0) {
+			if (cqe->res == -ENOBUFS) break;
+			if (op == OP_TAP_READ && cqe->res == -EINVAL && !u->oneshot_tap) {
+				do_debug("io_uring: no multishot read on tap, using one-shot reads\n");
+				u->oneshot_tap = 1;
+				break;
+			}
+			uring_fatal("Reading data", cqe->res);
+		}
+		if (!(cqe->flags & IORING_CQE_F_BUFFER)) break;
+		u->avail[g]--;
+		if (cqe->res == 0) {
+			uring_recycle(u, g, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+			if (op == OP_SOCK_RECV) u->eof = 1;
+			break;
+		}
+		c = &u->chunk[g][(u->chunk_front[g] + u->chunk_count[g])%URING_NBUFS];
+		c->bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		c->offset = 0;
+		c->length = cqe->res;
+		u->chunk_count[g]++;
+		if (op == OP_SOCK_RECV) u->sock_bytes += cqe->res;
+		break;
+	case OP_TAP_WRITE:
+	case OP_SOCK_WRITE:
+		if (cqe->res < 0) uring_fatal("Writing data", cqe->res);
+		if (cqe->res < u->slot[s].length) uring_fatal("Writing data", -EIO);
+		u->free_slot[u->nfree++] = s;
+		if (op == OP_TAP_WRITE) u->tap_inflight--;
+		else u->sock_inflight--;
+		break;
+	}
+}
+
+/**
+ * Submits the queued requests and processes every completion available,
+ * waiting for at least min_complete of them or until ts expires
+ *
+ * @brief	Submits and reaps completions
+ * @param	u io_uring instance
+ * @param	min_complete Completions to wait for
+ * @param	ts Relative timeout (NULL to wait without timeout)
+ *
+ */
+static void uring_enter(uring_t *u, int min_complete, struct timespec *ts) {
+	struct io_uring_getevents_arg arg;
+	unsigned head, tail;
+	long ret;
+
+	uring_chain(u);
+	uring_arm(u);
+
+	if (min_complete > 0) {
+		memset(&arg, 0, sizeof(arg));
+		arg.ts = (uint64_t)(uintptr_t)ts;
+		ret = syscall(__NR_io_uring_enter, u->fd, *u->sq_tail - *u->sq_head, min_complete,
+				IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	} else if (*u->sq_tail != *u->sq_head) {
+		ret = syscall(__NR_io_uring_enter, u->fd, *u->sq_tail - *u->sq_head, 0, 0, NULL, 0);
+	} else {
+		// Nothing to submit, just reap the completions already posted
+		ret = 0;
+	}
+	if (ret < 0 && errno != ETIME && errno != EINTR) {
+		perror("io_uring_enter()");
+		exit(1);
+	}
+
+	head = *u->cq_head;
+	tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		uring_complete(u, &u->cqes[head & *u->cq_mask]);
+		head++;
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * Copies bytes of the socket stream without consuming them
+ *
+ * @brief	Peeks the socket stream
+ * @param	u io_uring instance
+ * @param	buf Buffer to copy to
+ * @param	n Number of bytes (must be available)
+ *
+ */
+static void uring_peek(uring_t *u, char *buf, int n) {
+	uring_chunk_t *c;
+	int i, len;
+
+	for (i = 0; n > 0; i++) {
+		c = &u->chunk[SOCK][(u->chunk_front[SOCK] + i)%URING_NBUFS];
+		len = min(n, c->length - c->offset);
+		memcpy(buf, u->bufs[SOCK] + c->bid*URING_BUFSIZE + c->offset, len);
+		buf += len;
+		n -= len;
+	}
+}
+
+/**
+ * Checks if the socket stream holds a whole [length][payload] frame
+ *
+ * @brief	Checks for a whole frame
+ * @param	u io_uring instance
+ * @return	1 if true (or the peer closed the connection) 0 if false
+ *
+ */
+int uring_frame_ready(uring_t *u) {
+	uint16_t plength;
+
+	if (u->eof) return 1;
+	if (u->sock_bytes < (int)sizeof(plength)) return 0;
+	uring_peek(u, (char *)&plength, sizeof(plength));
+	return u->sock_bytes >= (int)sizeof(plength) + ntohs(plength);
+}
+
+/**
+ * Sets up the io_uring instance, its rings and the provided buffer rings,
+ * and arms the first reads. If anything fails, what was set up is released.
+ *
+ * @brief	Initializes a uring_t
+ * @param	u io_uring instance to initialize
+ * @param	fdtap tap file descriptor
+ * @param	fdsock socket file descriptor
+ * @return	0 if it succeeded -1 if the kernel does not support it
+ *
+ */
+int uring_init(uring_t *u, int fdtap, int fdsock) {
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	size_t sq_size = 0, cq_size = 0;
+	char *sq = MAP_FAILED, *cq;
+	int g, i;
+
+	memset(u, 0, sizeof(*u));
+	memset(&p, 0, sizeof(p));
+	u->fdtap = fdtap;
+	u->fdsock = fdsock;
+
+	if ((u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0) {
+		perror("io_uring_setup()");
+		return -1;
+	}
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+		do_debug("io_uring: kernel too old\n");
+		goto fail;
+	}
+
+	sq_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	sq = mmap(NULL, max(sq_size, cq_size), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	u->sqes = mmap(NULL, p.sq_entries*sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || u->sqes == MAP_FAILED) {
+		perror("mmap()");
+		goto fail;
+	}
+	cq = sq;
+	u->sq_head = (unsigned *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)(sq + p.sq_off.array);
+	u->cq_head = (unsigned *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	for (g = TAP; g <= SOCK; g++) {
+		u->br[g] = mmap(NULL, URING_NBUFS*sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		u->bufs[g] = malloc(URING_NBUFS*URING_BUFSIZE);
+		if (u->br[g] == MAP_FAILED || u->bufs[g] == NULL) {
+			perror("Allocating io_uring buffers");
+			goto fail;
+		}
+		memset(&reg, 0, sizeof(reg));
+		reg.ring_addr = (uint64_t)(uintptr_t)u->br[g];
+		reg.ring_entries = URING_NBUFS;
+		reg.bgid = g;
+		if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+			perror("io_uring_register(IORING_REGISTER_PBUF_RING)");
+			goto fail;
+		}
+		for (i = 0; i < URING_NBUFS; i++)
+			uring_recycle(u, g, i);
+	}
+
+	for (i = 0; i < URING_NSLOTS; i++)
+		u->free_slot[i] = i;
+	u->nfree = URING_NSLOTS;
+
+	do_debug("io_uring: %u entries, %d buffers of %d bytes per ring\n",
+			p.sq_entries, URING_NBUFS, URING_BUFSIZE);
+	uring_enter(u, 0, NULL);
+	return 0;
+
+fail:
+	close(u->fd);
+	for (g = TAP; g <= SOCK; g++) {
+		if (u->br[g] != NULL && u->br[g] != MAP_FAILED)
+			munmap(u->br[g], URING_NBUFS*sizeof(struct io_uring_buf));
+		free(u->bufs[g]);
+	}
+	if (u->sqes != NULL && u->sqes != MAP_FAILED)
+		munmap(u->sqes, p.sq_entries*sizeof(struct io_uring_sqe));
+	if (sq != MAP_FAILED) munmap(sq, max(sq_size, cq_size));
+	return -1;
+}
+
+/**
+ * Submits the queued requests and waits until there is data to read or the
+ * deadline is reached. It does not wait if there is data already waiting.
+ *
+ * @brief	Waits for io_uring events
+ * @param	u io_uring instance
+ * @param	deadline Wall time to stop waiting (NULL to wait for data)
+ * @return	ORed URING_* values
+ *
+ */
+int uring_wait(uring_t *u, struct timeval *deadline) {
+	struct timeval now;
+	struct timespec ts;
+	long int remain_usec;
+	int ret = 0;
+
+	if (u->chunk_count[TAP] > 0 || uring_frame_ready(u)) {
+		uring_enter(u, 0, NULL);
+	} else if (deadline == NULL) {
+		uring_enter(u, 1, NULL);
+	} else {
+		gettimeofday(&now,NULL);
+		remain_usec = (deadline->tv_sec - now.tv_sec)*1000000 +
+			(deadline->tv_usec - now.tv_usec);
+		if (remain_usec > 0) {
+			ts.tv_sec = remain_usec/1000000;
+			ts.tv_nsec = (remain_usec%1000000)*1000;
+			uring_enter(u, 1, &ts);
+		} else {
+			uring_enter(u, 0, NULL);
+		}
+	}
+
+	if (u->chunk_count[TAP] > 0) ret = ret | URING_TAP_IN;
+	if (uring_frame_ready(u)) ret = ret | URING_SOCK_IN;
+	if (u->tap_inflight == 0) ret = ret | URING_TAP_IDLE;
+	if (u->sock_inflight == 0 && u->backlog_count == 0) ret = ret | URING_SOCK_IDLE;
+	return ret;
+}
+
+/**
+ * Reads from the data already received on tap or socket, waiting for it if
+ * there is none. A tap read returns one packet, a socket read returns up to
+ * n bytes of the stream, as read(2) does.
+ *
+ * @brief	Reads received data
+ * @param	u io_uring instance
+ * @param	fd tap or socket file descriptor
+ * @param	buf Buffer to save to
+ * @param	n Size of buf
+ * @return	number of read bytes (0 if the socket was closed)
+ *
+ */
+int uring_read(uring_t *u, int fd, char *buf, int n) {
+	int g = (fd == u->fdtap) ? TAP : SOCK;
+	uring_chunk_t *c;
+	int len, nread = 0;
+
+	while (u->chunk_count[g] == 0) {
+		if (g == SOCK && u->eof) return 0;
+		uring_enter(u, 1, NULL);
+	}
+
+	while (u->chunk_count[g] > 0 && nread < n) {
+		c = &u->chunk[g][u->chunk_front[g]];
+		len = min(n - nread, c->length - c->offset);
+		memcpy(buf + nread, u->bufs[g] + c->bid*URING_BUFSIZE + c->offset, len);
+		nread += len;
+		c->offset += len;
+		// A tap buffer holds one packet, the rest is truncated as read(2) does
+		if (g == TAP || c->offset == c->length) {
+			uring_recycle(u, g, c->bid);
+			u->chunk_front[g] = (u->chunk_front[g] + 1)%URING_NBUFS;
+			u->chunk_count[g]--;
+		}
+		if (g == TAP) break;
+	}
+	if (g == SOCK) u->sock_bytes -= nread;
+	return nread;
+}
+
+/**
+ * Gets a free write slot, waiting for a write to complete if there is none
+ *
+ * @brief	Gets a write slot
+ * @param	u io_uring instance
+ * @return	write slot
+ *
+ */
+static int uring_slot(uring_t *u) {
+	while (u->nfree == 0)
+		uring_enter(u, 1, NULL);
+	return u->free_slot[--u->nfree];
+}
+
+/**
+ * Queues a filled write slot after the socket writes waiting for a chain
+ *
+ * @brief	Queues a socket write
+ * @param	u io_uring instance
+ * @param	s write slot
+ *
+ */
+static void uring_backlog(uring_t *u, int s) {
+	u->backlog[(u->backlog_front + u->backlog_count)%URING_NSLOTS] = s;
+	u->backlog_count++;
+}
+
+/**
+ * Copies the data to a write slot and queues its write, which is submitted
+ * with the next io_uring_enter. Writes to the socket are chained so they are
+ * done in order. A packet longer than a slot (a peer with a larger MTU) is
+ * dropped and counted.
+ *
+ * @brief	Writes data
+ * @param	u io_uring instance
+ * @param	fd tap or socket file descriptor
+ * @param	buf Buffer to write from
+ * @param	n Number of bytes to write
+ * @return	number of written bytes, 0 if dropped
+ *
+ */
+int uring_write(uring_t *u, int fd, char *buf, int n) {
+	struct io_uring_sqe *sqe;
+	int s;
+
+	if (n > URING_BUFSIZE) {
+		u->drops++;
+		do_debug("io_uring: packet of %d bytes dropped (%lu)\n", n, u->drops);
+		return 0;
+	}
+	s = uring_slot(u);
+	memcpy(u->slot[s].data, buf, n);
+	u->slot[s].length = n;
+
+	if (fd == u->fdtap) {
+		sqe = uring_sqe(u, IORING_OP_WRITE, fd, OP_TAP_WRITE | (s << 8));
+		sqe->addr = (uint64_t)(uintptr_t)u->slot[s].data;
+		sqe->len = n;
+		sqe->off = -1;
+		u->tap_inflight++;
+	} else {
+		uring_backlog(u, s);
+	}
+	return n;
+}
+
+/**
+ * Copies the data of several buffers to the socket stream, filling every
+ * write slot before taking the next one, so a batch of frames costs as few
+ * socket writes as possible. Tap writes are done buffer by buffer, every
+ * buffer being a packet.
+ *
+ * @brief	Writes data from several buffers
+ * @param	u io_uring instance
+ * @param	fd tap or socket file descriptor
+ * @param	iov Buffers to write from
+ * @param	iovcnt Number of buffers
+ * @return	number of written bytes
+ *
+ */
+int uring_writev(uring_t *u, int fd, struct iovec *iov, int iovcnt) {
+	int i, len, s = -1, n = 0;
+	size_t off;
+
+	if (fd == u->fdtap) {
+		for (i = 0; i < iovcnt; i++)
+			n += uring_write(u, fd, iov[i].iov_base, iov[i].iov_len);
+		return n;
+	}
+	for (i = 0; i < iovcnt; i++) {
+		for (off = 0; off < iov[i].iov_len; off += len) {
+			if (s >= 0 && u->slot[s].length == URING_BUFSIZE) {
+				uring_backlog(u, s);
+				s = -1;
+			}
+			if (s < 0) {
+				s = uring_slot(u);
+				u->slot[s].length = 0;
+			}
+			len = min(iov[i].iov_len - off, (size_t)(URING_BUFSIZE - u->slot[s].length));
+			memcpy(u->slot[s].data + u->slot[s].length, (char *)iov[i].iov_base + off, len);
+			u->slot[s].length += len;
+			n += len;
+		}
+	}
+	if (s >= 0) uring_backlog(u, s);
+	return n;
+}
@@ -0,0 +1,99 @@
+/**
+ * @file	uring.h
+ * @authors	simpletun contributors
+ * @date	October 2026
+ * @license GNU GPL	v3
+ * @brief	io_uring engine for the tap and socket I/O
+ *
+ */
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES	256		/**< submission queue entries */
+#define URING_NBUFS		256		/**< buffers of each provided buffer ring (power of 2) */
+#define URING_BUFSIZE	2048	/**< size of a receive buffer and of a write slot */
+#define URING_NSLOTS	128		/**< write slots */
+
+/* Define return values for uring_wait */
+#define URING_TAP_IN	0x01	/**< a packet read from tap is waiting */
+#define URING_SOCK_IN	0x02	/**< a whole frame read from socket is waiting */
+#define URING_TAP_IDLE	0x04	/**< there is no write in flight on tap */
+#define URING_SOCK_IDLE	0x08	/**< there is no write in flight on socket */
+
+/**
+ * Received data waiting to be consumed, it still lives in a provided buffer
+ *
+ * @brief	Provided buffer holding received data
+ */
+typedef struct {
+	uint16_t bid;		/**< buffer id in the buffer ring */
+	int offset;			/**< first byte not consumed yet */
+	int length;			/**< bytes received in the buffer */
+} uring_chunk_t;
+
+/**
+ * Data copied from the caller that has to stay alive until its write completes
+ *
+ * @brief	Write slot
+ */
+typedef struct {
+	int length;					/**< bytes to write */
+	char data[URING_BUFSIZE];	/**< data to write */
+} uring_slot_t;
+
+/**
+ * Multishot reads on tap and socket fill two provided buffer rings (one
+ * buffer group each). Every completion is kept as a uring_chunk_t until
+ * the data is read with uring_read, then the buffer goes back to its ring.
+ * Socket writes are linked in a single chain, and a new chain is only
+ * submitted when the previous one completes, so the byte stream is never
+ * reordered.
+ *
+ * @brief	io_uring instance with its buffer rings and write slots
+ */
+typedef struct {
+	int fd;							/**< io_uring file descriptor */
+	int fdtap;						/**< tap file descriptor */
+	int fdsock;						/**< socket file descriptor */
+
+	unsigned *sq_head;				/**< submission queue head (kernel) */
+	unsigned *sq_tail;				/**< submission queue tail */
+	unsigned *sq_mask;				/**< submission queue mask */
+	unsigned *sq_array;				/**< submission queue index array */
+	struct io_uring_sqe *sqes;		/**< submission queue entries */
+	unsigned *cq_head;				/**< completion queue head */
+	unsigned *cq_tail;				/**< completion queue tail (kernel) */
+	unsigned *cq_mask;				/**< completion queue mask */
+	struct io_uring_cqe *cqes;		/**< completion queue entries */
+
+	struct io_uring_buf_ring *br[2];	/**< provided buffer rings (tap, sock) */
+	char *bufs[2];					/**< memory of the provided buffers */
+	int avail[2];					/**< buffers currently in each ring */
+	int armed[2];					/**< multishot read armed on tap/sock */
+	int oneshot_tap;				/**< kernel without multishot read */
+	int eof;						/**< socket closed by peer */
+
+	uring_chunk_t chunk[2][URING_NBUFS];	/**< received data (tap, sock) */
+	int chunk_front[2];				/**< first chunk */
+	int chunk_count[2];				/**< number of chunks */
+	int sock_bytes;					/**< socket bytes received and not read */
+
+	uring_slot_t slot[URING_NSLOTS];	/**< write slots */
+	int free_slot[URING_NSLOTS];	/**< stack of free write slots */
+	int nfree;						/**< number of free write slots */
+	int backlog[URING_NSLOTS];		/**< socket writes waiting for a chain */
+	int backlog_front;				/**< first waiting socket write */
+	int backlog_count;				/**< number of waiting socket writes */
+	int tap_inflight;				/**< writes in flight on tap */
+	int sock_inflight;				/**< writes in flight on socket */
+	unsigned long drops;			/**< packets too long for a write slot, dropped */
+} uring_t;
+
+int uring_init(uring_t *u, int fdtap, int fdsock);
+int uring_wait(uring_t *u, struct timeval *deadline);
+int uring_frame_ready(uring_t *u);
+int uring_read(uring_t *u, int fd, char *buf, int n);
+int uring_write(uring_t *u, int fd, char *buf, int n);
+int uring_writev(uring_t *u, int fd, struct iovec *iov, int iovcnt);
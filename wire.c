@@ -0,0 +1,261 @@
+/**
+ * @file	wire.c
+ * @authors	simpletun contributors
+ * @date	October 2026
+ * @license GNU GPL	v3
+ * @brief	TPACKET_V3 packet rings for the bump-in-the-wire mode
+ *
+ * Each interface of the bridge gets a packet socket with a receive ring of
+ * blocks and a transmit ring of frames mapped into our memory, so captured
+ * frames are read without a syscall per frame, and frames queued in the
+ * transmit ring leave with a single send() per flush.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <arpa/inet.h> /* htons() */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h> /* exit() */
+#include <unistd.h>
+
+#include "wire.h"
+
+/* offset of the frame in a transmit ring slot (no PACKET_TX_HAS_OFF) */
+#define WIRE_TXOFF	(TPACKET3_HDRLEN - sizeof(struct sockaddr_ll))
+
+void do_debug(char *msg, ...);
+
+/**
+ * Creates a packet socket on an interface in promiscuous mode with its
+ * TPACKET_V3 rings. The frames we transmit are not captured back. With
+ * fanout, the sockets opened on the same interface share its traffic by
+ * flow hash, so every worker sees both directions of its flows.
+ *
+ * @brief	Opens the packet rings of an interface
+ * @param	w Instance to initialize
+ * @param	ifname Name of the interface
+ * @param	fanout Join the fanout group of the interface
+ * @return	The packet socket file descriptor
+ *
+ */
+int wire_open(wire_t *w, char *ifname, int fanout) {
+	struct tpacket_req3 req;
+	struct sockaddr_ll sll;
+	struct packet_mreq mr;
+	int version = TPACKET_V3, one = 1, ifindex, opt;
+	size_t rxlen;
+
+	memset(w, 0, sizeof(*w));
+	if ((ifindex = if_nametoindex(ifname)) == 0) {
+		perror("if_nametoindex()");
+		exit(1);
+	}
+	if ((w->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) < 0) {
+		perror("socket(AF_PACKET)");
+		exit(1);
+	}
+	if (setsockopt(w->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+		perror("setsockopt(PACKET_VERSION)");
+		exit(1);
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = WIRE_BLOCKSIZE;
+	req.tp_block_nr = WIRE_RXBLOCKS;
+	req.tp_frame_size = WIRE_FRAMESIZE;
+	req.tp_frame_nr = WIRE_RXBLOCKS * (WIRE_BLOCKSIZE / WIRE_FRAMESIZE);
+	req.tp_retire_blk_tov = WIRE_TIMEOUT;
+	if (setsockopt(w->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+		perror("setsockopt(PACKET_RX_RING)");
+		exit(1);
+	}
+	rxlen = (size_t)WIRE_RXBLOCKS * WIRE_BLOCKSIZE;
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = WIRE_BLOCKSIZE;
+	req.tp_block_nr = WIRE_TXBLOCKS;
+	req.tp_frame_size = WIRE_FRAMESIZE;
+	req.tp_frame_nr = WIRE_TXBLOCKS * (WIRE_BLOCKSIZE / WIRE_FRAMESIZE);
+	if (setsockopt(w->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+		perror("setsockopt(PACKET_TX_RING)");
+		exit(1);
+	}
+	w->txframes = req.tp_frame_nr;
+
+	w->maplen = rxlen + (size_t)WIRE_TXBLOCKS * WIRE_BLOCKSIZE;
+	w->map = mmap(NULL, w->maplen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, w->fd, 0);
+	if (w->map == MAP_FAILED) {
+		// locking is only best effort
+		w->map = mmap(NULL, w->maplen, PROT_READ | PROT_WRITE, MAP_SHARED, w->fd, 0);
+		if (w->map == MAP_FAILED) {
+			perror("mmap(packet rings)");
+			exit(1);
+		}
+	}
+	w->tx = w->map + rxlen;
+
+	if (setsockopt(w->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one)) < 0)
+		perror("setsockopt(PACKET_IGNORE_OUTGOING)");
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex = ifindex;
+	if (bind(w->fd, (struct sockaddr *) &sll, sizeof(sll)) < 0) {
+		perror("bind(AF_PACKET)");
+		exit(1);
+	}
+
+	memset(&mr, 0, sizeof(mr));
+	mr.mr_ifindex = ifindex;
+	mr.mr_type = PACKET_MR_PROMISC;
+	if (setsockopt(w->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, sizeof(mr)) < 0) {
+		perror("setsockopt(PACKET_ADD_MEMBERSHIP)");
+		exit(1);
+	}
+
+	if (fanout) {
+		// the flow hash is symmetric and both interfaces get as many
+		// sockets, so the two directions of a flow meet in the same worker
+		opt = ((getpid() + ifindex) & 0xffff) | (PACKET_FANOUT_HASH << 16);
+		if (setsockopt(w->fd, SOL_PACKET, PACKET_FANOUT, &opt, sizeof(opt)) < 0) {
+			perror("setsockopt(PACKET_FANOUT)");
+			exit(1);
+		}
+	}
+
+	w->blk = (struct tpacket_block_desc *) w->map;
+	return w->fd;
+}
+
+/**
+ * Returns a block of the receive ring to the kernel and moves to the next one
+ *
+ * @brief	Releases the receive block being read
+ * @param	w wire_t instance
+ *
+ */
+static void wire_release(wire_t *w) {
+	__sync_synchronize();
+	w->blk->hdr.bh1.block_status = TP_STATUS_KERNEL;
+	w->rxblock = (w->rxblock + 1)%WIRE_RXBLOCKS;
+	w->blk = (struct tpacket_block_desc *) (w->map + (size_t)w->rxblock * WIRE_BLOCKSIZE);
+	w->rxpkt = NULL;
+}
+
+/**
+ * Copies the next captured frame out of the receive ring. A block goes back
+ * to the kernel once all its frames have been read. Frames longer than buf
+ * (offloaded super-frames, the interfaces must have GRO disabled) or not
+ * captured whole are dropped rather than forwarded truncated, and counted.
+ *
+ * @brief	Reads a frame from the receive ring
+ * @param	w wire_t instance
+ * @param	buf Destination buffer
+ * @param	n Size of buf
+ * @return	Number of copied bytes, -1 if the ring is empty
+ *
+ */
+int wire_read(wire_t *w, char *buf, int n) {
+	struct tpacket3_hdr *pkt;
+	int len, fits;
+
+	do {
+		while (w->rxpkt == NULL) {
+			if (!(w->blk->hdr.bh1.block_status & TP_STATUS_USER)) return -1;
+			__sync_synchronize();
+			w->rxleft = w->blk->hdr.bh1.num_pkts;
+			if (w->rxleft > 0)
+				w->rxpkt = (struct tpacket3_hdr *) ((uint8_t *) w->blk + w->blk->hdr.bh1.offset_to_first_pkt);
+			else
+				wire_release(w);	// nothing in it, give it back
+		}
+
+		pkt = w->rxpkt;
+		len = pkt->tp_len;
+		fits = (len <= n && pkt->tp_snaplen == pkt->tp_len);
+		if (fits) {
+			memcpy(buf, (uint8_t *) pkt + pkt->tp_mac, len);
+		} else {
+			w->rxdrops++;
+			do_debug("wire: captured frame of %d bytes dropped (%lu)\n", len, w->rxdrops);
+		}
+
+		if (--w->rxleft > 0)
+			w->rxpkt = (struct tpacket3_hdr *) ((uint8_t *) pkt + pkt->tp_next_offset);
+		else
+			wire_release(w);
+	} while (!fits);
+	return len;
+}
+
+/**
+ * Copies a frame into the next free slot of the transmit ring, flushing and
+ * waiting for the kernel if the ring is full. The frame is sent by the next
+ * wire_flush.
+ *
+ * @brief	Queues a frame in the transmit ring
+ * @param	w wire_t instance
+ * @param	buf Frame to transmit
+ * @param	n Length of the frame
+ * @return	n, or -1 if the frame does not fit in a slot (counted as a drop)
+ *
+ */
+int wire_write(wire_t *w, char *buf, int n) {
+	struct tpacket3_hdr *hdr;
+	struct pollfd pfd;
+
+	if (n > WIRE_FRAMESIZE - (int)WIRE_TXOFF) {
+		w->txdrops++;
+		do_debug("wire: frame of %d bytes too long for the transmit ring (%lu)\n", n, w->txdrops);
+		errno = EMSGSIZE;
+		return -1;
+	}
+	hdr = (struct tpacket3_hdr *) (w->tx + (size_t)w->txframe * WIRE_FRAMESIZE);
+	while (hdr->tp_status != TP_STATUS_AVAILABLE) {
+		if (hdr->tp_status & TP_STATUS_WRONG_FORMAT) {
+			w->txdrops++;
+			do_debug("wire: frame dropped by the transmit ring (%lu)\n", w->txdrops);
+			hdr->tp_status = TP_STATUS_AVAILABLE;
+			break;
+		}
+		wire_flush(w);
+		pfd.fd = w->fd;
+		pfd.events = POLLOUT;
+		poll(&pfd, 1, -1);
+	}
+	memcpy((uint8_t *) hdr + WIRE_TXOFF, buf, n);
+	hdr->tp_len = n;
+	hdr->tp_next_offset = 0;
+	__sync_synchronize();
+	hdr->tp_status = TP_STATUS_SEND_REQUEST;
+	w->txframe = (w->txframe + 1)%w->txframes;
+	w->pending++;
+	return n;
+}
+
+/**
+ * Asks the kernel to transmit the frames queued in the transmit ring
+ *
+ * @brief	Sends the queued frames
+ * @param	w wire_t instance
+ *
+ */
+void wire_flush(wire_t *w) {
+	if (w->pending == 0) return;
+	if (send(w->fd, NULL, 0, MSG_DONTWAIT) < 0) {
+		// the device is busy, the frames wait for the next flush
+		if (errno == EAGAIN || errno == ENOBUFS) return;
+		perror("send(PACKET_TX_RING)");
+		exit(1);
+	}
+	w->pending = 0;
+}
@@ -0,0 +1,48 @@
+/**
+ * @file	wire.h
+ * @authors	simpletun contributors
+ * @date	October 2026
+ * @license GNU GPL	v3
+ * @brief	TPACKET_V3 packet rings for the bump-in-the-wire mode
+ *
+ */
+#include <stdint.h>
+#include <linux/if_packet.h>
+
+#define WIRE_BLOCKSIZE	(1 << 17)	/**< size of a ring block */
+#define WIRE_RXBLOCKS	32			/**< blocks of the receive ring */
+#define WIRE_TXBLOCKS	16			/**< blocks of the transmit ring */
+#define WIRE_FRAMESIZE	2048		/**< size of a transmit frame */
+#define WIRE_TIMEOUT	1			/**< ms before a partially filled block is retired */
+
+/**
+ * An AF_PACKET socket bound to an interface with a TPACKET_V3 receive ring
+ * followed by a transmit ring in the same mapping. The kernel fills whole
+ * receive blocks and hands them over at once; frames to transmit are
+ * queued in the transmit ring and sent together by wire_flush.
+ *
+ * @brief	Packet rings of an interface
+ */
+typedef struct {
+	int fd;							/**< packet socket file descriptor */
+	uint8_t *map;					/**< mapping of both rings */
+	size_t maplen;					/**< length of the mapping */
+
+	struct tpacket_block_desc *blk;	/**< receive block being read */
+	struct tpacket3_hdr *rxpkt;		/**< next packet of the block */
+	int rxblock;					/**< index of the block being read */
+	int rxleft;						/**< packets of the block not read yet */
+
+	uint8_t *tx;					/**< transmit ring */
+	int txframe;					/**< next transmit frame */
+	int txframes;					/**< frames of the transmit ring */
+	int pending;					/**< frames queued since the last flush */
+
+	unsigned long rxdrops;			/**< captured frames dropped, too long or truncated */
+	unsigned long txdrops;			/**< frames dropped, too long for a slot or refused */
+} wire_t;
+
+int wire_open(wire_t *w, char *ifname, int fanout);
+int wire_read(wire_t *w, char *buf, int n);
+int wire_write(wire_t *w, char *buf, int n);
+void wire_flush(wire_t *w);
@@ -0,0 +1,415 @@
+/**
+ * @file	xsk.c
+ * @authors	simpletun contributors
+ * @date	October 2026
+ * @license GNU GPL	v3
+ * @brief	AF_XDP sockets sharing a UMEM for the bump-in-the-wire mode
+ *
+ * A small XDP program (attached in generic mode, so it runs on any
+ * interface, veth included) redirects every frame of a queue to the AF_XDP
+ * socket registered for it. The two sockets of a worker, one per bridged
+ * interface, share a UMEM: a frame received on one interface is queued and
+ * transmitted on the other one from the same memory.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <net/if.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h> /* exit() */
+#include <unistd.h>
+
+#include "xsk.h"
+
+#define XSK_MASK	(XSK_RINGSIZE - 1)
+
+/**
+ * bpf() system call, there is no libc wrapper
+ *
+ * @brief	bpf() system call
+ * @param	cmd Command
+ * @param	attr Attributes of the command
+ * @return	As bpf()
+ *
+ */
+static int sys_bpf(int cmd, union bpf_attr *attr) {
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/**
+ * Loads the redirecting XDP program with its socket map and attaches it in
+ * generic mode to an interface. The frames of a queue without a registered
+ * socket go to the network stack. The program stays attached until we exit.
+ *
+ * @brief	Attaches the XDP program to an interface
+ * @param	ifname Name of the interface
+ * @param	nqueues Number of queues (sockets) of the map
+ * @return	The socket map file descriptor
+ *
+ */
+int xsk_attach(char *ifname, int nqueues) {
+	union bpf_attr attr;
+	int mapfd, progfd, ifindex;
+
+	if ((ifindex = if_nametoindex(ifname)) == 0) {
+		perror("if_nametoindex()");
+		exit(1);
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(int);
+	attr.value_size = sizeof(int);
+	attr.max_entries = nqueues;
+	if ((mapfd = sys_bpf(BPF_MAP_CREATE, &attr)) < 0) {
+		perror("bpf(BPF_MAP_CREATE)");
+		exit(1);
+	}
+
+	/* return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS); */
+	struct bpf_insn prog[] = {
+		{ .code = BPF_LDX | BPF_MEM | BPF_W, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1,
+		  .off = offsetof(struct xdp_md, rx_queue_index) },
+		{ .code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = BPF_REG_1, .src_reg = BPF_PSEUDO_MAP_FD,
+		  .imm = mapfd },
+		{ 0 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3, .imm = XDP_PASS },
+		{ .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_redirect_map },
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (uint64_t)(unsigned long) prog;
+	attr.insn_cnt = sizeof(prog)/sizeof(prog[0]);
+	attr.license = (uint64_t)(unsigned long) "GPL";
+	attr.expected_attach_type = BPF_XDP;
+	if ((progfd = sys_bpf(BPF_PROG_LOAD, &attr)) < 0) {
+		perror("bpf(BPF_PROG_LOAD)");
+		exit(1);
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = progfd;
+	attr.link_create.target_ifindex = ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+	if (sys_bpf(BPF_LINK_CREATE, &attr) < 0) {
+		perror("bpf(BPF_LINK_CREATE)");
+		exit(1);
+	}
+	return mapfd;
+}
+
+/**
+ * Allocates the frames of a UMEM, all of them free
+ *
+ * @brief	Initializes a xsk_umem_t
+ * @param	u UMEM to initialize
+ *
+ */
+void xsk_umem_init(xsk_umem_t *u) {
+	int i;
+
+	u->area = mmap(NULL, (size_t)XSK_FRAMES * XSK_FRAMESIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	u->free = malloc(XSK_FRAMES * sizeof(uint64_t));
+	u->ref = calloc(XSK_FRAMES, 1);
+	if (u->area == MAP_FAILED || u->free == NULL || u->ref == NULL) {
+		perror("Allocating UMEM");
+		exit(1);
+	}
+	for (i = 0; i < XSK_FRAMES; i++)
+		u->free[i] = (uint64_t)(XSK_FRAMES - 1 - i) * XSK_FRAMESIZE;
+	u->nfree = XSK_FRAMES;
+}
+
+/**
+ * Maps a ring of a socket
+ *
+ * @brief	Maps a ring
+ * @param	r Ring to map
+ * @param	fd Socket file descriptor
+ * @param	off Offsets of the ring in its mapping
+ * @param	descsize Size of a descriptor
+ * @param	pgoff Offset of the ring mapping
+ *
+ */
+static void xsk_map(xsk_ring_t *r, int fd, struct xdp_ring_offset *off, size_t descsize, off_t pgoff) {
+	r->maplen = off->desc + XSK_RINGSIZE * descsize;
+	r->map = mmap(NULL, r->maplen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+	if (r->map == MAP_FAILED) {
+		perror("mmap(AF_XDP ring)");
+		exit(1);
+	}
+	r->producer = (uint32_t *) ((uint8_t *) r->map + off->producer);
+	r->consumer = (uint32_t *) ((uint8_t *) r->map + off->consumer);
+	r->desc = (uint8_t *) r->map + off->desc;
+}
+
+/**
+ * Gives a frame back when its last owner lets it go
+ *
+ * @brief	Drops an owner of a frame
+ * @param	u UMEM
+ * @param	addr Address of the frame (or of data inside it)
+ *
+ */
+static void xsk_unref(xsk_umem_t *u, uint64_t addr) {
+	uint64_t frame = addr / XSK_FRAMESIZE;
+
+	if (--u->ref[frame] == 0)
+		u->free[u->nfree++] = frame * XSK_FRAMESIZE;
+}
+
+/**
+ * Hands free frames to the kernel to receive in
+ *
+ * @brief	Refills the fill ring
+ * @param	x xsk_t instance
+ *
+ */
+static void xsk_refill(xsk_t *x) {
+	xsk_umem_t *u = x->umem;
+	uint32_t prod = *x->fill.producer;
+	uint32_t room = XSK_RINGSIZE - (prod - __atomic_load_n(x->fill.consumer, __ATOMIC_ACQUIRE));
+
+	for (; room > 0 && u->nfree > 0; room--, prod++)
+		((uint64_t *) x->fill.desc)[prod & XSK_MASK] = u->free[--u->nfree];
+	__atomic_store_n(x->fill.producer, prod, __ATOMIC_RELEASE);
+}
+
+/**
+ * Releases the frames the kernel has transmitted
+ *
+ * @brief	Reads the completion ring
+ * @param	x xsk_t instance
+ *
+ */
+static void xsk_reap(xsk_t *x) {
+	uint32_t cons = *x->comp.consumer;
+	uint32_t prod = __atomic_load_n(x->comp.producer, __ATOMIC_ACQUIRE);
+
+	for (; cons != prod; cons++)
+		xsk_unref(x->umem, ((uint64_t *) x->comp.desc)[cons & XSK_MASK]);
+	__atomic_store_n(x->comp.consumer, cons, __ATOMIC_RELEASE);
+}
+
+/**
+ * Creates an AF_XDP socket on a queue of an interface and registers it in
+ * the socket map of the XDP program. The first socket on a UMEM registers
+ * it, the second one shares it (on another interface, with its own fill
+ * and completion rings). Frames are copied by the kernel (XDP_COPY), as
+ * generic XDP requires.
+ *
+ * @brief	Opens an AF_XDP socket
+ * @param	x Instance to initialize
+ * @param	u UMEM of the socket
+ * @param	ifname Name of the interface
+ * @param	queue Queue of the interface
+ * @param	mapfd Socket map of the interface (xsk_attach)
+ * @param	shared Socket already registering u, NULL if none
+ * @return	The socket file descriptor
+ *
+ */
+int xsk_open(xsk_t *x, xsk_umem_t *u, char *ifname, int queue, int mapfd, xsk_t *shared) {
+	struct xdp_umem_reg mr;
+	struct xdp_mmap_offsets off;
+	struct sockaddr_xdp sxdp;
+	union bpf_attr attr;
+	socklen_t optlen = sizeof(off);
+	int size = XSK_RINGSIZE, ifindex;
+
+	memset(x, 0, sizeof(*x));
+	x->umem = u;
+	if ((ifindex = if_nametoindex(ifname)) == 0) {
+		perror("if_nametoindex()");
+		exit(1);
+	}
+	if ((x->fd = socket(AF_XDP, SOCK_RAW, 0)) < 0) {
+		perror("socket(AF_XDP)");
+		exit(1);
+	}
+	if (shared == NULL) {
+		memset(&mr, 0, sizeof(mr));
+		mr.addr = (uint64_t)(unsigned long) u->area;
+		mr.len = (uint64_t)XSK_FRAMES * XSK_FRAMESIZE;
+		mr.chunk_size = XSK_FRAMESIZE;
+		if (setsockopt(x->fd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof(mr)) < 0) {
+			perror("setsockopt(XDP_UMEM_REG)");
+			exit(1);
+		}
+	}
+	if (setsockopt(x->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) < 0 ||
+			setsockopt(x->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) < 0 ||
+			setsockopt(x->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) < 0 ||
+			setsockopt(x->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) < 0) {
+		perror("setsockopt(AF_XDP rings)");
+		exit(1);
+	}
+	if (getsockopt(x->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0) {
+		perror("getsockopt(XDP_MMAP_OFFSETS)");
+		exit(1);
+	}
+	xsk_map(&x->rx, x->fd, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING);
+	xsk_map(&x->tx, x->fd, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING);
+	xsk_map(&x->fill, x->fd, &off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING);
+	xsk_map(&x->comp, x->fd, &off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING);
+
+	memset(&sxdp, 0, sizeof(sxdp));
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = ifindex;
+	sxdp.sxdp_queue_id = queue;
+	if (shared == NULL) {
+		sxdp.sxdp_flags = XDP_COPY;
+	} else {
+		// the copy mode comes with the UMEM
+		sxdp.sxdp_flags = XDP_SHARED_UMEM;
+		sxdp.sxdp_shared_umem_fd = shared->fd;
+	}
+	if (bind(x->fd, (struct sockaddr *) &sxdp, sizeof(sxdp)) < 0) {
+		perror("bind(AF_XDP)");
+		exit(1);
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = mapfd;
+	attr.key = (uint64_t)(unsigned long) &queue;
+	attr.value = (uint64_t)(unsigned long) &x->fd;
+	if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+		perror("bpf(BPF_MAP_UPDATE_ELEM)");
+		exit(1);
+	}
+
+	xsk_refill(x);
+	return x->fd;
+}
+
+/**
+ * Takes the next received frame. It stays in its UMEM frame, owned by the
+ * caller until xsk_put.
+ *
+ * @brief	Receives a frame
+ * @param	x xsk_t instance
+ * @param[out]	len Length of the frame
+ * @return	The frame, NULL if none was received
+ *
+ */
+uint8_t *xsk_recv(xsk_t *x, int *len) {
+	struct xdp_desc *desc;
+	uint32_t cons = *x->rx.consumer;
+
+	if (cons == __atomic_load_n(x->rx.producer, __ATOMIC_ACQUIRE)) return NULL;
+	desc = &((struct xdp_desc *) x->rx.desc)[cons & XSK_MASK];
+	x->umem->ref[desc->addr / XSK_FRAMESIZE] = 1;
+	*len = desc->len;
+	__atomic_store_n(x->rx.consumer, cons + 1, __ATOMIC_RELEASE);
+	return x->umem->area + desc->addr;
+}
+
+/**
+ * Tells if a buffer lives in the UMEM
+ *
+ * @param	u UMEM
+ * @param	buf Buffer
+ * @return	1 if true 0 if false
+ *
+ */
+int xsk_owns(xsk_umem_t *u, void *buf) {
+	return (uint8_t *) buf >= u->area && (uint8_t *) buf < u->area + (size_t)XSK_FRAMES * XSK_FRAMESIZE;
+}
+
+/**
+ * Posts a frame to the transmit ring, sent by the next xsk_flush. A frame
+ * of the UMEM is posted as it is (and kept until its completion even if
+ * its owner puts it), any other buffer is copied to a free frame first.
+ *
+ * @brief	Queues a frame for transmission
+ * @param	x xsk_t instance
+ * @param	buf Frame to transmit
+ * @param	n Length of the frame
+ * @return	n, or -1 if there is no frame to copy it to
+ *
+ */
+int xsk_write(xsk_t *x, char *buf, int n) {
+	xsk_umem_t *u = x->umem;
+	struct xdp_desc *desc;
+	struct pollfd pfd;
+	uint64_t addr;
+	uint32_t prod;
+
+	if (xsk_owns(u, buf)) {
+		addr = (uint8_t *) buf - u->area;
+	} else {
+		if (u->nfree == 0) xsk_reap(x);
+		if (u->nfree == 0 || n > XSK_FRAMESIZE - XDP_PACKET_HEADROOM) {
+			errno = ENOBUFS;
+			return -1;
+		}
+		addr = u->free[--u->nfree] + XDP_PACKET_HEADROOM;
+		memcpy(u->area + addr, buf, n);
+	}
+
+	prod = *x->tx.producer;
+	while (prod - __atomic_load_n(x->tx.consumer, __ATOMIC_ACQUIRE) == XSK_RINGSIZE) {
+		xsk_flush(x);
+		pfd.fd = x->fd;
+		pfd.events = POLLOUT;
+		poll(&pfd, 1, 1);
+	}
+	desc = &((struct xdp_desc *) x->tx.desc)[prod & XSK_MASK];
+	desc->addr = addr;
+	desc->len = n;
+	desc->options = 0;
+	u->ref[addr / XSK_FRAMESIZE]++;
+	__atomic_store_n(x->tx.producer, prod + 1, __ATOMIC_RELEASE);
+	x->pending++;
+	return n;
+}
+
+/**
+ * Lets a received frame go, it is free once transmitted
+ *
+ * @brief	Releases a frame
+ * @param	u UMEM
+ * @param	buf Frame (or data inside it)
+ *
+ */
+void xsk_put(xsk_umem_t *u, void *buf) {
+	xsk_unref(u, (uint8_t *) buf - u->area);
+}
+
+/**
+ * Kicks the transmission of the posted frames, releases the transmitted
+ * ones and hands the free frames to the kernel
+ *
+ * @brief	Sends the posted frames
+ * @param	x xsk_t instance
+ *
+ */
+void xsk_flush(xsk_t *x) {
+	int i;
+
+	// a kick in copy mode only sends a batch of frames
+	for (i = 0; x->pending > 0 && i < XSK_RINGSIZE/16; i++) {
+		if (sendto(x->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 &&
+				errno != EAGAIN && errno != EBUSY && errno != ENOBUFS) {
+			perror("sendto(AF_XDP)");
+			exit(1);
+		}
+		if (__atomic_load_n(x->tx.consumer, __ATOMIC_ACQUIRE) == *x->tx.producer)
+			x->pending = 0;
+	}
+	xsk_reap(x);
+	xsk_refill(x);
+}
@@ -0,0 +1,66 @@
+/**
+ * @file	xsk.h
+ * @authors	simpletun contributors
+ * @date	October 2026
+ * @license GNU GPL	v3
+ * @brief	AF_XDP sockets sharing a UMEM for the bump-in-the-wire mode
+ *
+ */
+#include <stdint.h>
+#include <linux/if_xdp.h>
+
+#define XSK_FRAMES		4096	/**< frames of a UMEM */
+#define XSK_FRAMESIZE	4096	/**< size of a UMEM frame */
+#define XSK_RINGSIZE	1024	/**< descriptors of every ring (power of 2) */
+
+/**
+ * Single producer single consumer ring shared with the kernel
+ *
+ * @brief	AF_XDP ring
+ */
+typedef struct {
+	uint32_t *producer;		/**< producer index */
+	uint32_t *consumer;		/**< consumer index */
+	void *desc;				/**< descriptors (xdp_desc or UMEM addresses) */
+	void *map;				/**< mapping of the ring */
+	size_t maplen;			/**< length of the mapping */
+} xsk_ring_t;
+
+/**
+ * Memory the frames are received in and transmitted from. A frame can be
+ * owned both by a queue (until the packet in it is released) and by a
+ * transmit ring (until its completion), it is free when both let it go.
+ *
+ * @brief	UMEM of the sockets of a worker
+ */
+typedef struct {
+	uint8_t *area;			/**< the frames */
+	uint64_t *free;			/**< stack of free frame addresses */
+	int nfree;				/**< number of free frames */
+	uint8_t *ref;			/**< owners of every frame */
+} xsk_umem_t;
+
+/**
+ * An AF_XDP socket bound to a queue of an interface with its own fill and
+ * completion rings on the UMEM
+ *
+ * @brief	AF_XDP socket
+ */
+typedef struct {
+	int fd;					/**< socket file descriptor */
+	xsk_umem_t *umem;		/**< UMEM of the socket */
+	xsk_ring_t rx;			/**< received frames */
+	xsk_ring_t tx;			/**< frames to transmit */
+	xsk_ring_t fill;		/**< free frames handed to the kernel */
+	xsk_ring_t comp;		/**< transmitted frames */
+	int pending;			/**< frames posted since the last kick */
+} xsk_t;
+
+int xsk_attach(char *ifname, int nqueues);
+void xsk_umem_init(xsk_umem_t *u);
+int xsk_open(xsk_t *x, xsk_umem_t *u, char *ifname, int queue, int mapfd, xsk_t *shared);
+uint8_t *xsk_recv(xsk_t *x, int *len);
+int xsk_write(xsk_t *x, char *buf, int n);
+int xsk_owns(xsk_umem_t *u, void *buf);
+void xsk_put(xsk_umem_t *u, void *buf);
+void xsk_flush(xsk_t *x);
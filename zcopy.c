@@ -0,0 +1,174 @@
+/**
+ * @file	zcopy.c
+ * @authors	simpletun contributors
+ * @date	October 2026
+ * @license GNU GPL	v3
+ * @brief	MSG_ZEROCOPY transmission of frames on the tunnel socket
+ *
+ * Frames are held (with their length prefix) before being sent with
+ * MSG_ZEROCOPY and released when the socket error queue reports that the
+ * kernel is done with them. If the kernel refuses the zerocopy send (out of
+ * option memory) the frames are sent copying them and released at once.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/errqueue.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h> /* exit() */
+
+#include "zcopy.h"
+
+void do_debug(char *msg, ...);
+
+/**
+ * Enables MSG_ZEROCOPY on a socket
+ *
+ * @brief	Initializes a zcopy_t
+ * @param	z Instance to initialize
+ * @param	fd Socket file descriptor
+ * @param	release Function returning a buffer to its owner
+ * @return	0 if succeeded, -1 if the socket does not support it
+ *
+ */
+int zcopy_init(zcopy_t *z, int fd, void (*release)(void *)) {
+	int one = 1;
+
+	memset(z, 0, sizeof(*z));
+	z->release = release;
+	if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+		perror("setsockopt(SO_ZEROCOPY)");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Holds a buffer until the completion of the next zerocopy send, waiting
+ * for completions if too many frames are held
+ *
+ * @brief	Holds a frame for the next send
+ * @param	z zcopy_t instance
+ * @param	fd Socket file descriptor
+ * @param	pkt Buffer to release on completion
+ * @param	plength Length prefix (network order) to send with it
+ * @return	Pointer to the held copy of plength, to be sent instead
+ *
+ */
+uint16_t *zcopy_hold(zcopy_t *z, int fd, void *pkt, uint16_t plength) {
+	struct pollfd pfd;
+	zc_frame_t *f;
+
+	while (z->count == ZC_MAX) {
+		// only the error queue can wake us (POLLERR)
+		pfd.fd = fd;
+		pfd.events = 0;
+		poll(&pfd, 1, -1);
+		zcopy_reap(z, fd);
+	}
+	f = &z->frame[(z->front + z->count)%ZC_MAX];
+	f->pkt = pkt;
+	f->plength = plength;
+	f->id = z->next_id;
+	z->count++;
+	z->staged++;
+	return &f->plength;
+}
+
+/**
+ * Sends the data of the held frames with MSG_ZEROCOPY, or copying it if the
+ * kernel can not take it (then the frames are released at once)
+ *
+ * @brief	Sends the held frames
+ * @param	z zcopy_t instance
+ * @param	fd Socket file descriptor
+ * @param	iov Buffers of the held frames
+ * @param	iovcnt Number of buffers
+ * @return	number of sent bytes
+ *
+ */
+int zcopy_send(zcopy_t *z, int fd, struct iovec *iov, int iovcnt) {
+	struct msghdr msg;
+	int n, i;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	if ((n = sendmsg(fd, &msg, MSG_ZEROCOPY)) >= 0) {
+		z->next_id++;
+		z->sent++;
+		z->staged = 0;
+		return n;
+	}
+	if (errno != ENOBUFS) {
+		perror("Writing data");
+		exit(1);
+	}
+	// Out of option memory for the notifications: copy
+	if ((n = sendmsg(fd, &msg, 0)) < 0) {
+		perror("Writing data");
+		exit(1);
+	}
+	for (i = 0; i < z->staged; i++) {
+		z->count--;
+		z->release(z->frame[(z->front + z->count)%ZC_MAX].pkt);
+	}
+	z->staged = 0;
+	return n;
+}
+
+/**
+ * Reads the completions waiting in the socket error queue and releases the
+ * frames they cover
+ *
+ * @brief	Releases the completed frames
+ * @param	z zcopy_t instance
+ * @param	fd Socket file descriptor
+ * @return	number of released frames
+ *
+ */
+int zcopy_reap(zcopy_t *z, int fd) {
+	char control[128];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *serr;
+	zc_frame_t *f;
+	int released = 0;
+
+	while (1) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) break;
+			perror("Reading completions");
+			exit(1);
+		}
+		for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+			serr = (struct sock_extended_err *) CMSG_DATA(cm);
+			if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				z->copied += serr->ee_data - serr->ee_info + 1;
+			// sends ee_info..ee_data completed (ids wrap around)
+			while (z->count - z->staged > 0) {
+				f = &z->frame[z->front];
+				if ((int32_t)(f->id - serr->ee_data) > 0) break;
+				z->release(f->pkt);
+				z->front = (z->front + 1)%ZC_MAX;
+				z->count--;
+				released++;
+			}
+		}
+	}
+	if (released)
+		do_debug("zerocopy: %d frames released, %lu sends, %lu copied\n",
+				released, z->sent, z->copied);
+	return released;
+}
@@ -0,0 +1,46 @@
+/**
+ * @file	zcopy.h
+ * @authors	simpletun contributors
+ * @date	October 2026
+ * @license GNU GPL	v3
+ * @brief	MSG_ZEROCOPY transmission of frames on the tunnel socket
+ *
+ */
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define ZC_MAX	1024	/**< frames waiting for their completion */
+
+/**
+ * A frame sent with MSG_ZEROCOPY: the kernel reads it from our memory until
+ * the completion of its send arrives, so it can not be released before
+ *
+ * @brief	Frame waiting for its completion
+ */
+typedef struct {
+	void *pkt;			/**< buffer to release on completion */
+	uint16_t plength;	/**< length prefix sent with the buffer */
+	uint32_t id;		/**< notification id of the send */
+} zc_frame_t;
+
+/**
+ * Every sendmsg with MSG_ZEROCOPY gets the next 32 bit notification id.
+ * TCP completes them in order, so the frames wait in a FIFO.
+ *
+ * @brief	Frames waiting for their zerocopy completions
+ */
+typedef struct {
+	zc_frame_t frame[ZC_MAX];	/**< frames waiting */
+	int front;					/**< first frame */
+	int count;					/**< number of frames waiting */
+	int staged;					/**< frames held for the next send */
+	uint32_t next_id;			/**< notification id of the next send */
+	void (*release)(void *);	/**< returns a buffer to its owner */
+	unsigned long sent;			/**< zerocopy sends */
+	unsigned long copied;		/**< sends the kernel copied anyway */
+} zcopy_t;
+
+int zcopy_init(zcopy_t *z, int fd, void (*release)(void *));
+uint16_t *zcopy_hold(zcopy_t *z, int fd, void *pkt, uint16_t plength);
+int zcopy_send(zcopy_t *z, int fd, struct iovec *iov, int iovcnt);
+int zcopy_reap(zcopy_t *z, int fd);